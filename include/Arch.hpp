@@ -19,6 +19,13 @@ namespace Arch
 {
 #ifdef TARGET_X86_64
 	constexpr uint64_t C_RFLAGS_INTERRUPT_FLAG = 0x200;
+	constexpr uint64_t C_CR0_NW    = BIT(29);
+	constexpr uint64_t C_CR0_CD    = BIT(30);
+	constexpr uint64_t C_CR4_PGE   = BIT(7);
+	constexpr uint64_t C_CR4_PCIDE = BIT(17);
+	
+	// If set when writing CR3, the TLB entries tagged with the new PCID are kept.
+	constexpr uint64_t C_CR3_NOFLUSH = BIT(63);
 	
 	struct TSS
 	{
@@ -33,7 +40,7 @@ namespace Arch
 	PACKED;
 	
 	// The GDT structure. It contains an array of uint64s, which represents
-	// each of the GDT entries, and potentially a TSS entry. (todo)
+	// each of the GDT entries, and the TSS entry.
 	struct GDT
 	{
 		// The segment numbers.
@@ -48,10 +55,14 @@ namespace Arch
 			DESC_64BIT_RING0_DATA = 0x30,
 			DESC_64BIT_RING3_CODE = 0x38,
 			DESC_64BIT_RING3_DATA = 0x40,
+			DESC_TSS              = 0x48,
 		};
 		
 		uint64_t m_BasicEntries[9];
 		
+		// The TSS descriptor takes up two entries.
+		uint64_t m_TssEntry[2];
+		
 		TSS m_tss;
 	};
 	
@@ -59,10 +70,12 @@ namespace Arch
 	{
 		enum
 		{
-			INT_PAGE_FAULT = 0x0E,
-			INT_IPI        = 0xF0,
-			INT_APIC_TIMER = 0xF1,
-			INT_SPURIOUS   = 0xFF,
+			INT_PAGE_FAULT    = 0x0E,
+			INT_IPI           = 0xF0,
+			INT_APIC_TIMER    = 0xF1,
+			INT_TLB_SHOOTDOWN = 0xF2,
+			INT_CACHE_DRAIN   = 0xF3,
+			INT_SPURIOUS      = 0xFF,
 		};
 		
 		struct Entry
@@ -154,6 +167,162 @@ namespace Arch
 		
 		// Load the RSDP root table.
 		void Load();
+		
+		// Find a table by its signature. Does not use the kernel heap, so it may be used before it's initialized.
+		Table* FindTable(const char* pSignature);
+	}
+	
+	namespace NUMA
+	{
+		// The maximum number of NUMA nodes supported.
+		constexpr int C_MAX_NODES = 8;
+		
+		// Parses the SRAT and SLIT tables. This function must be run on the bootstrap CPU, before the PMM is initialized.
+		void Init();
+		
+		// Get the number of NUMA nodes. This is always at least 1.
+		int GetNodeCount();
+		
+		// Get the node a physical address belongs to. The length is clamped to the end of the node's memory range.
+		int GetNodeOfRange(uintptr_t base, uint64_t& length);
+		
+		// Get the node a local APIC belongs to.
+		int GetNodeOfLapic(uint32_t lapicID);
+		
+		// Get the relative distance between two nodes. The distance from a node to itself is 10.
+		int GetDistance(int from, int to);
+	}
+	
+	namespace TLB
+	{
+		// If a flush covers more pages than this, the whole TLB is flushed instead of using INVLPG on each page.
+		constexpr size_t C_FULL_FLUSH_THRESHOLD = 32;
+		
+		// The maximum number of distinct ranges a batch or a CPU's queue can hold before it's turned into a full flush.
+		constexpr size_t C_MAX_RANGES = 16;
+		
+		struct Range
+		{
+			uintptr_t m_start;
+			size_t    m_pageCount;
+		};
+		
+		// A list of ranges to flush. Overlapping and adjacent ranges are merged together.
+		struct RangeList
+		{
+			Range  m_ranges[C_MAX_RANGES];
+			size_t m_rangeCount = 0;
+			size_t m_pageCount  = 0;
+			bool   m_bFullFlush = false;
+			
+			void Add(uintptr_t start, size_t pageCount);
+			void Add(const RangeList& other);
+			void Clear();
+			bool Empty() const { return !m_bFullFlush && m_rangeCount == 0; }
+		};
+		
+		// The queue of flush requests a CPU receives from other CPUs.
+		struct Queue
+		{
+			Spinlock  m_lock;
+			RangeList m_pending;
+			
+			// Whether a shootdown IPI was sent which the CPU hasn't yet picked up.
+			bool m_bIpiPending = false;
+			
+			// Whether this CPU takes part in shootdowns. Set right before interrupts are first enabled.
+			Atomic<bool> m_bOnline { false };
+			
+			// The generation of the latest request, and that of the latest request that has been carried out.
+			Atomic<uint64_t> m_requestedGen { 0 };
+			Atomic<uint64_t> m_completedGen { 0 };
+		};
+		
+		// The number of PCIDs each CPU hands out to page mappings. PCID 0 is left to the mapping the bootloader gave us.
+		constexpr int C_PCID_COUNT = 32;
+		
+		struct PcidSlot
+		{
+			// The physical address of the PML4 of the page mapping this PCID belongs to.
+			uintptr_t m_owner = 0;
+			
+			// The generation of the page mapping, and the CPU's flush generation, when the PCID was last loaded.
+			uint64_t  m_ownerGen = 0;
+			uint64_t  m_flushGen = 0;
+			
+			// When this PCID was last loaded, used to pick the one to recycle.
+			uint64_t  m_lastUse = 0;
+		};
+		
+		// The PCIDs owned by a CPU.
+		struct PcidCache
+		{
+			bool m_bEnabled = false;
+			
+			// Whether INVPCID is supported, which can flush every PCID at once.
+			bool m_bInvpcid = false;
+			
+			PcidSlot m_slots[C_PCID_COUNT];
+			
+			int m_current = 0;
+			
+			// Bumped whenever kernel mappings are flushed, since INVLPG and CR3 reloads only flush the current PCID.
+			uint64_t m_flushGen = 0;
+			
+			uint64_t m_clock = 0;
+		};
+		
+		struct Stats
+		{
+			uint64_t m_ipisSent;
+			uint64_t m_pagesFlushed;
+			uint64_t m_fullFlushes;
+			uint64_t m_pcidHits;
+			uint64_t m_pcidRecycles;
+		};
+		
+		// Collects ranges whose mappings were changed, and flushes them from the TLB of every CPU that may
+		// have cached them, using one IPI per CPU. The flush happens when Flush() is called or when the batch
+		// goes out of scope.
+		// Addresses in the lower half are only flushed locally, because each CPU owns its lower half mapping.
+		class Batch
+		{
+		public:
+			Batch() = default;
+			Batch(const Batch&) = delete;
+			Batch& operator=(const Batch&) = delete;
+			
+			~Batch() { Flush(); }
+			
+			void Add(uintptr_t addr, size_t pageCount = 1);
+			
+			void Flush();
+			
+		private:
+			RangeList m_local;
+			RangeList m_global;
+		};
+		
+		// Flushes a range from the TLB of every CPU that may have cached it.
+		void Shootdown(uintptr_t addr, size_t pageCount = 1);
+		
+		// Marks the current CPU as taking part in shootdowns. Used by the CPU during its initialization.
+		void OnCPUOnline();
+		
+		// Carries out the flushes that were queued on the current CPU. This must be run with interrupts disabled.
+		void ProcessQueue();
+		
+		// Flushes the entire TLB of the current CPU, including global pages, under every PCID.
+		void FlushAll();
+		
+		// Enables PCIDs on the current CPU, if supported. Must be run before the CPU's page mapping is switched to.
+		void InitPCID();
+		
+		// Loads a page mapping into CR3 under the PCID assigned to it on this CPU, assigning one if needed.
+		// The TLB entries tagged with the PCID are kept, unless the mapping's generation has changed since.
+		void LoadAddressSpace(uintptr_t pml4, uint64_t generation);
+		
+		Stats GetStats();
 	}
 	
 	typedef void(*PolledSleepFunc)(uint64_t);
@@ -175,7 +344,7 @@ namespace Arch
 		// Get the LAPIC's base address. This is not offset by the HHDM.
 		uintptr_t GetLapicBasePhys();
 		
-		// Get the LAPIC's base address. This is offset by the HHDM.
+		// Get the LAPIC's base address, as a virtual address.
 		uintptr_t GetLapicBase();
 		
 		// Schedule a one-shot interrupt in X nanoseconds.
@@ -185,6 +354,9 @@ namespace Arch
 		// Tell the APIC that we are done processing its interrupt.
 		void EndOfInterrupt();
 		
+		// Send an interrupt to the CPU with the specified local APIC ID. This must be run with interrupts disabled.
+		void SendIPI(uint32_t lapicID, uint8_t vector);
+		
 		// Calibrate the APIC and TSC timers using the PIT or HPET. Used by the CPU.
 		// Returns the frequency of ticks per millisecond.
 		// This is not thread safe, so be sure to add locking before going in.
@@ -248,6 +420,10 @@ namespace Arch
 		
 		static constexpr size_t C_INTERRUPT_STACK_SIZE = 8192;
 		
+		// The IST slot of the page fault handler's stack. Page faults need a known good stack, since
+		// they can be caused by a thread touching a page of its own stack for the first time.
+		static constexpr uint8_t C_PAGE_FAULT_IST = 1;
+		
 		/**** CPU specific variables ****/
 	private:
 		// The index of this processor.
@@ -268,9 +444,32 @@ namespace Arch
 		// The main page mapping.
 		VMM::PageMapping* m_pPageMap = nullptr;
 		
+		// The NUMA node this CPU belongs to.
+		int m_NumaNode = 0;
+		
+		// The cache of free physical pages owned by this CPU.
+		PMM::PageCache m_PageCache;
+		
+		// The slab caches owned by this CPU.
+		VMM::SlabArena m_SlabArena;
+		
+		// This CPU's lists of free objects, one for each KObjectPool.
+		KObjectPoolList m_ObjectPoolLists[C_MAX_OBJECT_POOLS] = {};
+		
+#ifdef TARGET_X86_64
+		// The TLB flushes other CPUs have requested from this CPU.
+		TLB::Queue m_TlbQueue;
+		
+		// The PCIDs this CPU has handed out.
+		TLB::PcidCache m_PcidCache;
+#endif
+		
 		// The interrupt handler stack.
 		void* m_pIsrStack = nullptr;
 		
+		// The page fault handler's stack.
+		void* m_pPageFaultStack = nullptr;
+		
 		// The current IPI type.
 		eIpiType m_ipiType = eIpiType::NONE;
 		
@@ -376,6 +575,29 @@ namespace Arch
 		// Get the scheduler.
 		Scheduler* GetScheduler() { return &m_Scheduler; }
 		
+		// Get the NUMA node this CPU belongs to.
+		int GetNumaNode() const { return m_NumaNode; }
+		
+		// Get the page cache. This may only be used with interrupts disabled.
+		PMM::PageCache* GetPageCache() { return &m_PageCache; }
+		
+		// Get the slab arena. This may only be used with interrupts disabled.
+		VMM::SlabArena* GetSlabArena() { return &m_SlabArena; }
+		
+		// Get the list of free objects of an object pool. This may only be used with interrupts disabled.
+		KObjectPoolList& GetObjectPoolList(int slot) { return m_ObjectPoolLists[slot]; }
+		
+#ifdef TARGET_X86_64
+		// Get the queue of TLB flushes requested from this CPU.
+		TLB::Queue& GetTlbQueue() { return m_TlbQueue; }
+		
+		// Get the PCIDs this CPU has handed out. This may only be used with interrupts disabled.
+		TLB::PcidCache& GetPcidCache() { return m_PcidCache; }
+		
+		// Get the ID of this CPU's local APIC.
+		uint32_t GetLapicID() const { return m_pSMPInfo->lapic_id; }
+#endif
+		
 		// Check if interrupts are enabled.
 		bool InterruptsEnabled() { return m_InterruptsEnabled; }
 		
@@ -385,6 +607,8 @@ namespace Arch
 		{
 #ifdef TARGET_X86_64
 			ClearIDT();
+			
+			m_NumaNode = NUMA::GetNodeOfLapic(pSMPInfo->lapic_id);
 #endif
 		}
 		
@@ -400,6 +624,9 @@ namespace Arch
 		// Send this CPU an IPI.
 		void SendIPI(eIpiType type);
 		
+		// Ask this CPU to drain its page cache. This must be run with interrupts disabled.
+		void SendDrainIPI();
+		
 		/**** CPU agnostic operations ****/
 	public:
 		// Get the number of CPUs available to the system.
@@ -444,12 +671,24 @@ namespace Arch
 	
 	// x86_64 architecture specific functions.
 #ifdef TARGET_X86_64
+	// Gets the contents of CR0.
+	uintptr_t ReadCR0();
+	
+	// Sets the contents of CR0.
+	void WriteCR0(uintptr_t cr0);
+	
 	// Gets the contents of CR3.
 	uintptr_t ReadCR3();
 	
 	// Sets the contents of CR3.
 	void WriteCR3(uintptr_t cr3);
 	
+	// Gets the contents of CR4.
+	uintptr_t ReadCR4();
+	
+	// Sets the contents of CR4.
+	void WriteCR4(uintptr_t cr4);
+	
 	// Reads a single byte from an I/O port.
 	uint8_t ReadByte(uint16_t port);
 	
@@ -462,6 +701,7 @@ namespace Arch
 		FS_BASE = 0xC0000100,
 		GS_BASE = 0xC0000101,
 		KERNEL_GS_BASE = 0xC0000102,
+		IA32_PAT       = 0x277,
 	};
 	
 	// Get the HHDM offset (higher half direct map).
@@ -476,6 +716,9 @@ namespace Arch
 	// Writes to a model specific register.
 	uint64_t ReadMSR(uint32_t msr);
 	
+	// Programs this CPU's page attribute table, so that the memory types in VMM::eMemoryType can be used.
+	void InitPAT();
+	
 	// Write a 32-bit integer to any address within physical memory.
 	// This assumes an HHDM is present and the entire physical address space is mapped.
 	void WritePhys(uintptr_t ptr, uint32_t thing);
@@ -10,15 +10,20 @@
 #ifndef _KARRAY_HPP
 #define _KARRAY_HPP
 
+#include <MemoryManager.hpp>
+
 // NOTE: This structure is NOT thread safe.
 
-// NOTE: TODO: Use the kernel heap directly instead of initializing extra elements that will go unused.
+// The container is allocated from the kernel heap directly, so that growing it can happen in place, and
+// the elements past the size are never initialized. Elements are moved around by copying their bytes.
 
 // This will mostly be used with pointer types, so this is probably fine.
 
 template<typename T>
 class KArray
 {
+	static_assert(__is_trivially_copyable(T), "KArray elements are moved around by copying their bytes");
+	
 public:
 	KArray()
 	{
@@ -30,7 +35,7 @@ public:
 	{
 		if (m_container)
 		{
-			delete[] m_container;
+			VMM::KernelHeap::Free(m_container);
 			m_container = nullptr;
 			m_container_size = 0;
 			m_container_capacity = 0;
@@ -55,16 +60,12 @@ public:
 		if (sz < m_container_size)
 			sz = m_container_size;
 		
-		T* newData = new T[sz];
-		for (size_t i = 0; i < m_container_size; i++)
-		{
-			newData[i] = m_container[i];
-		}
+		T* newData = (T*)VMM::KernelHeap::Reallocate(m_container, sz * sizeof(T));
+		if (!newData)
+			KernelPanic("ERROR: cannot grow KArray to %z elements, kernel heap gave us NULL.", sz);
 		
-		T* oldContainer = m_container;
 		m_container = newData;
-		
-		delete[] oldContainer;
+		m_container_capacity = sz;
 	}
 	
 	virtual void PushBack(const T &t)
@@ -118,7 +119,9 @@ public:
 	
 	void Clear()
 	{
-		delete m_container;
+		if (m_container)
+			VMM::KernelHeap::Free(m_container);
+		
 		SetupDefaultContainer();
 	}
 	
@@ -136,8 +139,11 @@ private:
 	void SetupDefaultContainer()
 	{
 		m_container_capacity = 16; // the default.
-		m_container = new T[m_container_capacity];
+		m_container = (T*)VMM::KernelHeap::Allocate(m_container_capacity * sizeof(T));
 		m_container_size = 0;
+		
+		if (!m_container)
+			KernelPanic("ERROR: cannot create KArray, kernel heap gave us NULL.");
 	}
 	
 private:
@@ -10,8 +10,12 @@
 #ifndef _KLIST_HPP
 #define _KLIST_HPP
 
+#include <KObjectPool.hpp>
+
 // NOTE: This structure is NOT thread safe.
 
+// The nodes come from an object pool shared by every list of the same type.
+
 // This linked list based structure can be used as either a linked list,
 // or a queue, or a deque (double-ended queue). The scheduler uses this
 // data structure in all three ways.
@@ -88,6 +92,17 @@ class KList
 	
 	ListNode *m_pFirst = nullptr, *m_pLast = nullptr;
 	
+	static inline KObjectPool<ListNode> s_NodePool;
+	
+	static ListNode* CreateNode(const T& element)
+	{
+		ListNode* pNode = s_NodePool.New(element);
+		if (!pNode)
+			KernelPanic("ERROR: cannot allocate a list node, the object pool gave us NULL.");
+		
+		return pNode;
+	}
+	
 public:
 	bool Empty()
 	{
@@ -96,7 +111,7 @@ public:
 	
 	void AddBack(const T& element)
 	{
-		ListNode* pNode = new ListNode(element);
+		ListNode* pNode = CreateNode(element);
 		
 		if (m_pLast)
 			m_pLast->m_pNext = pNode;
@@ -111,7 +126,7 @@ public:
 	
 	void AddFront(const T& element)
 	{
-		ListNode* pNode = new ListNode(element);
+		ListNode* pNode = CreateNode(element);
 		
 		if (m_pFirst)
 			m_pFirst->m_pPrev = pNode;
@@ -161,7 +176,7 @@ public:
 		if (!pNode)
 		{
 			// this is the only node.
-			delete m_pFirst;
+			s_NodePool.Delete(m_pFirst);
 			
 			m_pFirst = m_pLast = nullptr;
 			return;
@@ -169,7 +184,7 @@ public:
 		
 		pNode->m_pPrev = nullptr;
 		
-		delete m_pFirst;
+		s_NodePool.Delete(m_pFirst);
 		m_pFirst = pNode;
 	}
 	
@@ -183,7 +198,7 @@ public:
 			pNode->m_pPrev->m_pNext = pNode->m_pNext;
 		if (pNode->m_pNext)
 			pNode->m_pNext->m_pPrev = pNode->m_pPrev;
-		delete pNode;
+		s_NodePool.Delete(pNode);
 	}
 	
 	void Erase(const ListNodeIterator& iter)
@@ -203,14 +218,14 @@ public:
 		if (!pNode)
 		{
 			// this is the only node.
-			delete m_pLast;
+			s_NodePool.Delete(m_pLast);
 			
 			m_pLast = m_pFirst = nullptr;
 			return;
 		}
 		
 		pNode->m_pNext = nullptr;
-		delete m_pLast;
+		s_NodePool.Delete(m_pLast);
 		m_pLast = pNode;
 	}
 };
@@ -0,0 +1,104 @@
+//  ***************************************************************
+//  KObjectPool.hpp - Creation date: 17/10/2023
+//  -------------------------------------------------------------
+//  NanoShell64 Copyright (C) 2023 - Licensed under GPL V3
+//
+//  ***************************************************************
+//  Programmer(s):  iProgramInCpp (iprogramincpp@gmail.com)
+//  ***************************************************************
+
+#ifndef _KOBJECTPOOL_HPP
+#define _KOBJECTPOOL_HPP
+
+#include <MemoryManager.hpp>
+#include <Spinlock.hpp>
+
+// A pool of objects of a single type, carved out of pages taken straight from the PMM. Every CPU keeps
+// its own list of free objects for each pool, so allocating and freeing an object never takes a lock.
+
+// NOTE: A freed object goes to the list of the CPU that freed it. Once that list grows too long, a batch
+// of it is moved to the pool's shared list, which a CPU whose list runs dry takes from before carving up
+// a new page. The pages are never given back to the PMM, so the memory of an object stays valid, if
+// unused, for as long as the kernel runs.
+
+// The maximum number of pools. Every CPU keeps a free list for each of them.
+constexpr int C_MAX_OBJECT_POOLS = 16;
+
+// A list of free objects. A zeroed one is empty.
+struct KObjectPoolList
+{
+	void*  m_pHead;
+	size_t m_count;
+};
+
+// The untyped part of a pool. It has no constructor of its own, and a zeroed one is ready to use, so
+// pools can be declared as globals without worrying about the order the constructors run in.
+class KObjectPoolBase
+{
+protected:
+	void* AllocateObject(size_t slotSize, size_t slotCount);
+	void FreeObject(void* pObj);
+	
+private:
+	// Gets the index of this pool's list in every CPU, picking one the first time. Returns -1 if there are no more.
+	int GetSlot();
+	
+	// Takes an object off a free list, refilling it from a new chunk if it's empty.
+	static void* PopObject(KObjectPoolList& list, size_t slotSize, size_t slotCount);
+	
+	// Puts an object on a free list.
+	static void PushObject(KObjectPoolList& list, void* pObj);
+	
+	// Moves up to a certain amount of objects from the front of one free list to another.
+	static void MoveObjects(KObjectPoolList& from, KObjectPoolList& to, size_t count);
+	
+	// If a free finds a CPU's list at this length, a batch of its objects is moved to the shared list.
+	static constexpr size_t C_HIGH_WATERMARK = 256;
+	
+	// The amount of objects moved between a CPU's list and the shared list at a time.
+	static constexpr size_t C_BATCH_SIZE = 64;
+	
+	// The index of this pool's list in every CPU, plus one. Zero means it hasn't been picked yet.
+	Atomic<int> m_slot;
+	
+	// The list used before the CPUs are set up, or when we ran out of slots. The CPUs also spill their
+	// excess objects onto it, and take them back from it when their own lists run dry.
+	KObjectPoolList m_sharedList;
+	Spinlock        m_sharedListLock;
+};
+
+template<typename T>
+class KObjectPool : public KObjectPoolBase
+{
+public:
+	// Each slot has to be able to hold the link to the next free object, and keep the objects aligned.
+	static constexpr size_t C_SLOT_SIZE = ((sizeof(T) > sizeof(void*) ? sizeof(T) : sizeof(void*)) + alignof(T) - 1) & ~(alignof(T) - 1);
+	
+	// The pool is refilled a page at a time.
+	static constexpr size_t C_OBJECTS_PER_CHUNK = PAGE_SIZE / C_SLOT_SIZE;
+	
+	static_assert(C_OBJECTS_PER_CHUNK != 0, "Objects in a KObjectPool must fit in a page");
+	
+	// Allocates and constructs an object. Returns NULL if we're out of memory.
+	template<typename... Args>
+	T* New(const Args&... args)
+	{
+		void* pMem = AllocateObject(C_SLOT_SIZE, C_OBJECTS_PER_CHUNK);
+		if (!pMem)
+			return nullptr;
+		
+		return new (pMem) T(args...);
+	}
+	
+	// Destructs an object and gives it back to the pool.
+	void Delete(T* pObj)
+	{
+		if (!pObj)
+			return;
+		
+		pObj->~T();
+		FreeObject(pObj);
+	}
+};
+
+#endif
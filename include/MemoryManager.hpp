@@ -18,48 +18,193 @@
 // Address Layout:
 // 0x0000'0000'0000'0000 - 0x0000'FFFF'FFFF'FFFF: User mappable memory region.
 // 0x0001'0000'0000'0000 - 0xFFFE'FFFF'FFFF'FFFF: Non-canonical address gap.
-// 0xFFFF'8000'0000'0000 - 0xFFFF'EFFF'FFFF'FFFF: The HHDM mapping. This part and the ones below will have their PML4's verbatim copied
-// 0xFFFF'F000'0000'0000 - 0xFFFF'FFFD'FFFF'FFFF: The kernel heap.
-// 0xFFFF'FFFE'0000'0000 - 0xFFFE'FFFF'FFFF'FFFF: Single page hrdware mappings.
+// 0xFFFF'8000'0000'0000 - 0xFFFF'9FFF'FFFF'FFFF: The HHDM mapping. This part and the ones below will have their PML4's verbatim copied
+// 0xFFFF'A000'0000'0000 - 0xFFFF'A00F'FFFF'FFFF: The kernel heap (C_KERNEL_HEAP_START, C_KERNEL_HEAP_MAX_SIZE = 64 GB).
+// 0xFFFF'A010'0000'0000 - 0xFFFF'EFFF'FFFF'FFFF: Unused.
+// 0xFFFF'F000'0000'0000 - 0xFFFF'F001'FFFF'FFFF: Kernel virtual address ranges, handed out by VMM::AllocateVirtual (C_KVA_START, C_KVA_SIZE = 8 GB).
+// 0xFFFF'F002'0000'0000 - 0xFFFF'FFFE'FFFF'FFFF: Unused.
 // 0xFFFF'FFFF'0000'0000 - 0xFFFF'FFFF'FFFF'FFFF: The kernel itself.
 
 #include <NanoShell.hpp>
+#include <Atomic.hpp>
+#include <Spinlock.hpp>
 
 constexpr uint64_t PAGE_SIZE = 4096;
 
+// A huge page is mapped by a single page directory entry.
+constexpr uint64_t HUGE_PAGE_SIZE  = 0x200000;
+constexpr int      HUGE_PAGE_ORDER = 9; // log2(HUGE_PAGE_SIZE / PAGE_SIZE)
+
 namespace PMM
 {
 	constexpr uintptr_t INVALID_PAGE = 0;
 	
-	struct PageFreeListNode
+	// The largest block order the buddy allocator hands out. (2^10 pages = 4 MB)
+	constexpr int C_MAX_ORDER = 10;
+	
+	// The "no frame" index, used to terminate the buddy free lists.
+	constexpr uint32_t C_NO_FRAME = 0xFFFFFFFF;
+	
+	// The maximum number of memory areas.
+	constexpr int C_MAX_MEMORY_AREAS = 1024;
+	
+	// The size of a section of the physical address space, used to look up memory areas quickly. (2^27 = 128 MB)
+	constexpr int C_SECTION_SHIFT = 27;
+	
+	// Flags for a page frame.
+	constexpr uint8_t
+	PF_FREE   = BIT(0), // This frame is the head of a free buddy block.
+	PF_CACHED = BIT(1), // This frame is in a per-CPU page cache.
+	PF_ZEROED = BIT(2), // This frame is in a zeroed page pool.
+	PF_SLAB   = BIT(3); // This frame is the head of a slab.
+	
+	// Describes a single physical page frame. These are stored in an array at the start of the
+	// memory area they describe, so the free pages themselves are never touched by the allocator.
+	struct PageFrame
 	{
-		PageFreeListNode *pPrev, *pNext;
+		union
+		{
+			// The links of the free list this frame is part of, if it's the head of a free block.
+			struct
+			{
+				uint32_t m_next, m_prev;
+			};
+			
+			// If this frame holds the PML4 of a page mapping, the mapping's generation.
+			uint64_t m_pageMapGen;
+			
+			// If this frame holds a PML3, page directory or page table, the number of its entries that aren't zero.
+			uint32_t m_usedEntries;
+		};
+		// The order of the block this frame heads.
+		uint8_t  m_order;
+		uint8_t  m_flags;
+		// The index of the memory area this frame belongs to.
+		uint16_t m_area;
+		// The amount of references to this frame. The block is freed once this drops to zero.
+		Atomic<uint32_t> m_refCount;
 	};
 	
+	static_assert(sizeof(PageFrame) == 16, "PageFrame must be 16 bytes");
+	
 	struct MemoryArea
 	{
 		// The link to the next MemoryArea entry.
 		MemoryArea* m_pLink;
-		// The start of the physical memory this bitmap represents.
+		// The start of the physical memory this area manages.
 		uintptr_t m_startAddr;
-		// The length (in pages) of this PMM bitmap.
+		// The length (in pages) of this area.
 		size_t    m_length;
 		// The amount of pages free. This should always be kept in sync.
 		size_t    m_freePages;
+		// The frame descriptors of this area's pages.
+		PageFrame* m_pFrames;
+		// The amount of pages carved off the start of the area. The pages (and descriptors) past this were never touched.
+		size_t    m_carved;
+		// The heads of the free lists, one for each order.
+		uint32_t  m_freeLists[C_MAX_ORDER + 1];
+		// The NUMA node this area belongs to.
+		int       m_node;
+		// The index of this area, in address order.
+		uint16_t  m_index;
 		
-		PageFreeListNode *m_pFirst, *m_pLast;
+		MemoryArea(uintptr_t start, size_t len, PageFrame* pFrames, int node) : m_pLink(nullptr), m_startAddr(start), m_length(len), m_freePages(0), m_pFrames(pFrames), m_carved(0), m_node(node), m_index(0)
+		{
+			for (int i = 0; i <= C_MAX_ORDER; i++)
+				m_freeLists[i] = C_NO_FRAME;
+		}
 		
-		MemoryArea(uintptr_t start, size_t len) : m_pLink(nullptr), m_startAddr(start), m_length(len), m_freePages(len)
+		bool Contains(uintptr_t paddr) const
 		{
+			return m_startAddr <= paddr && paddr < m_startAddr + m_length * PAGE_SIZE;
 		}
 		
-		uintptr_t RemoveFirst();
-		void PushBack(uintptr_t paddr);
+		bool IsCarved(uintptr_t paddr) const
+		{
+			return (paddr - m_startAddr) / PAGE_SIZE < m_carved;
+		}
+		
+		PageFrame* GetPageFrame(uintptr_t paddr)
+		{
+			return &m_pFrames[(paddr - m_startAddr) / PAGE_SIZE];
+		}
+		
+		// Allocates a block of 2^order pages. Returns INVALID_PAGE if there's no block big enough.
+		uintptr_t AllocateBlock(int order);
+		
+		// Frees a block of 2^order pages, merging it with its buddies where possible. Returns false if it was already free.
+		bool FreeBlock(uintptr_t paddr, int order);
+		
+	private:
+		// Carves the next naturally aligned block off the never-touched part of the area, and puts it on its free list.
+		// Returns the order of the block, or -1 if the entire area has been carved already.
+		int Carve();
+		
+		void PushFree(uint32_t index, int order);
+		void RemoveFree(uint32_t index, int order);
+	};
+	
+	// A per-CPU cache of free pages in front of the global free lists. Pages are handed out
+	// in LIFO order, so the most recently freed (likely still cache-hot) page is reused first.
+	// When an allocation finds the cache empty, it's refilled with a batch of pages.
+	// Note: This may only be accessed by the CPU that owns it, with interrupts disabled. When another CPU
+	// runs out of memory, it asks the owner to drain the cache through an IPI, instead of reaching in.
+	struct PageCache
+	{
+		// The maximum amount of pages this cache can hold.
+		static constexpr size_t C_CAPACITY = 256;
+		
+		// The amount of pages moved between the cache and the global free lists at a time.
+		static constexpr size_t C_BATCH_SIZE = 64;
+		
+		// If a free finds the cache at this level, a batch of its coldest pages is drained.
+		static constexpr size_t C_HIGH_WATERMARK = C_CAPACITY;
+		
+		uintptr_t m_pages[C_CAPACITY];
+		size_t    m_count = 0;
+		
+		// Whether the owning CPU takes drain requests. Set right before interrupts are first enabled.
+		Atomic<bool> m_bOnline { false };
+		
+		// The generation of the latest drain request, and that of the latest one that has been carried out.
+		Atomic<uint64_t> m_requestedGen { 0 };
+		Atomic<uint64_t> m_completedGen { 0 };
+		
+		// Grabs a batch of pages from the global free lists, preferring the specified NUMA node.
+		void Refill(int preferredNode);
+		
+		// Gives a batch of the least recently freed pages back to the global free lists.
+		void Drain();
+		
+		// Gives every page back to the global free lists.
+		void DrainAll();
+	};
+	
+	// The amount of pre-zeroed pages each NUMA node keeps around.
+	constexpr uint64_t C_ZEROED_POOL_SIZE = 1024;
+	
+	// Statistics of the zeroed page pool.
+	struct ZeroedPoolStats
+	{
+		// The amount of zeroed page allocations satisfied by the pool.
+		uint64_t m_hits;
+		// The amount of zeroed page allocations that had to zero a page themselves.
+		uint64_t m_misses;
+		// The amount of pages zeroed in the background.
+		uint64_t m_pagesZeroed;
+		// The amount of pages currently in the pool.
+		uint64_t m_poolSize;
 	};
 	
 	// Get the total amount of pages available to the system. Never changes after init.
 	uint64_t GetTotalPages();
 	
+	// Get the total amount of pages a NUMA node has. Never changes after init.
+	uint64_t GetTotalPages(int node);
+	
+	// Get the amount of free pages a NUMA node has. Pages held in the per-CPU caches are not counted.
+	uint64_t GetFreePages(int node);
+	
 	// Initializes the PMM using the Limine memory map request.
 	// This function must be run on the bootstrap CPU.
 	void Init();
@@ -69,19 +214,95 @@ namespace PMM
 	//uintptr_t AllocatePage(uint64_t& hint);
 	uintptr_t AllocatePage();
 	
-	// Free a page within the PMM.
+	// Drop a reference to a page within the PMM, freeing it if that was the last one.
 	void FreePage(uintptr_t page);
 	
+	// Add a reference to an allocated page or block. It's only freed once FreePage has been called for each reference.
+	void ReferencePage(uintptr_t page);
+	
+	// Get the descriptor of a physical page. Returns NULL if the page isn't managed by the PMM.
+	PageFrame* GetPageFrame(uintptr_t page);
+	
+	// Get the memory area a page frame belongs to.
+	MemoryArea* GetMemoryArea(const PageFrame* pFrame);
+	
+	// Log the state of a physical page.
+	void DumpPageFrame(uintptr_t page);
+	
+	// Allocate a page filled with zeroes. Pages zeroed in the background are used first.
+	uintptr_t AllocateZeroedPage();
+	
+	// Zero up to `count` free pages into the current NUMA node's zeroed page pool. Used by the idle thread.
+	// Returns false if there's nothing more to do for now.
+	bool ZeroFreePages(size_t count);
+	
+	// Get the statistics of the zeroed page pool.
+	ZeroedPoolStats GetZeroedPoolStats();
+	
+	// Allocate `count` single pages at once, taking the PMM locks as few times as possible.
+	// Returns the amount of pages actually allocated, which is less than `count` if we're running out of memory.
+	size_t AllocatePages(size_t count, uintptr_t* pPages);
+	
+	// Drop a reference to each page in an array, taking the PMM locks as few times as possible.
+	void FreePages(const uintptr_t* pPages, size_t count);
+	
+	// Allocate a physically contiguous block of 2^order pages, aligned to its size.
+	uintptr_t AllocatePages(int order);
+	
+	// Allocate a block of 2^order pages, preferring the specified NUMA node over the current CPU's.
+	uintptr_t AllocatePagesOnNode(int node, int order);
+	
+	// Turns an allocated block of 2^order pages into 2^order single page allocations, which can then be freed individually.
+	// Each page inherits the block's reference count.
+	void SplitBlock(uintptr_t addr, int order);
+	
+	// Free a block of 2^order pages allocated with AllocatePages.
+	void FreePages(uintptr_t addr, int order);
+	
+	// Start taking page cache drain requests from other CPUs. Called right before interrupts are first enabled.
+	void OnCPUOnline();
+	
+	// Drain the current CPU's page cache if another CPU has asked for it. This must be run with interrupts disabled.
+	void ProcessDrainRequest();
+	
+	// Hands out single pages from batched allocations, so the PMM locks aren't taken for each page.
+	// Any pages that weren't handed out are freed when this goes out of scope.
+	class PageBatch
+	{
+	public:
+		static constexpr size_t C_SIZE = 64;
+		
+		PageBatch() = default;
+		~PageBatch();
+		
+		PageBatch(const PageBatch&) = delete;
+		PageBatch& operator=(const PageBatch&) = delete;
+		
+		// Get a page. Returns INVALID_PAGE if we're out of memory.
+		uintptr_t Get();
+		
+	private:
+		uintptr_t m_pages[C_SIZE];
+		size_t    m_count = 0;
+		size_t    m_index = 0;
+	};
+	
 	// Test out the PMM.
 	void Test();
 }
 
 namespace VMM
 {
-	constexpr uintptr_t C_KERNEL_HEAP_START = 0xFFFFA00000000000;
-	constexpr uintptr_t C_KERNEL_HEAP_SIZE  = 0x1600000; // 16 MB
+	constexpr uintptr_t C_KERNEL_HEAP_START    = 0xFFFFA00000000000;
+	constexpr uintptr_t C_KERNEL_HEAP_MAX_SIZE = 0x1000000000; // 64 GB
 	
-	constexpr uintptr_t C_HPET_MAP_ADDRESS  = 0xFFFFFFFE00000000;
+	// The kernel heap is committed in chunks, starting with a single one.
+	constexpr uintptr_t C_KERNEL_HEAP_CHUNK_SIZE   = HUGE_PAGE_SIZE;
+	constexpr uintptr_t C_KERNEL_HEAP_INITIAL_SIZE = C_KERNEL_HEAP_CHUNK_SIZE;
+	
+	// The region kernel virtual address ranges are handed out from.
+	constexpr uintptr_t C_KVA_START = 0xFFFFF00000000000;
+	constexpr uintptr_t C_KVA_SIZE  = 0x200000000; // 8 GB
 	
 	// The PML4 indices of the memory regions.
 	enum ePml4Limit
@@ -92,6 +313,7 @@ namespace VMM
 		P_HHDM_START  = 0x100,
 		P_HHDM_END    = 0x1D0,
 		P_KHEAP       = 0x1D0, // one page is enough I would think.
+		P_KVA         = 0x1E0,
 		P_KERNEL_PML4 = 0x1FF,
 		P_KERN_END    = 0x200,
 	};
@@ -105,13 +327,81 @@ namespace VMM
 	PE_CACHEDISABLE   = BIT(4),
 	PE_ACCESSED       = BIT(5),
 	PE_DIRTY          = BIT(6),
-	PE_PAT            = BIT(7),
+	PE_PAT            = BIT(7),  // In page table entries.
+	PE_PAGESIZE       = BIT(7),  // In page directory entries. This entry maps a 2 MB page.
 	PE_GLOBAL         = BIT(8),
+	PE_PAT_HUGE       = BIT(12), // In page directory entries that map a 2 MB page.
 	PE_PARTOFPMM      = BIT(9),  // NanoShell64 specific
 	PE_NEEDALLOCPAGE  = BIT(10), // NanoShell64 specific
-	PE_BIT11          = BIT(11),
+	PE_COPYONWRITE    = BIT(11), // NanoShell64 specific
 	PE_EXECUTEDISABLE = BIT(63);
 	
+	// The bits of a page entry that hold the physical address.
+	constexpr uint64_t C_PAGE_ADDRESS_MASK = 0x000FFFFFFFFFF000;
+	
+	// The maximum fault around window of a demand paged entry.
+	constexpr int C_MAX_FAULT_AROUND = 63;
+	
+	struct FaultStats
+	{
+		// The number of faults that allocated a demand paged page.
+		uint64_t m_demandFaults;
+		// The number of pages allocated ahead of time, around a faulting page.
+		uint64_t m_faultAroundPages;
+		// The number of compressed pages that were brought back on access.
+		uint64_t m_pagesRestored;
+	};
+	
+	// Gets the page fault statistics.
+	FaultStats GetFaultStats();
+	
+	// A non-present demand paged entry whose address field has this bit set is a compressed page. The byte the
+	// page was filled with is kept in the low 8 bits of the address field, since the protection key only fits a nibble.
+	constexpr uint64_t C_COMPRESSED_PAGE_MARK = 0x100;
+	
+	struct CompressStats
+	{
+		// The number of pages that were compressed into their page entry.
+		uint64_t m_pagesCompressed;
+		// The number of compressed pages that were brought back on access.
+		uint64_t m_pagesRestored;
+		// The amount of memory the pages that are still compressed would take up.
+		uint64_t m_bytesSaved;
+	};
+	
+	// Gets the page compression statistics.
+	CompressStats GetCompressStats();
+	
+	union PageEntry;
+	
+	// Accounts for an entry going away, either because its page was brought back or because it was unmapped.
+	// Entries that don't hold a compressed page are ignored.
+	void ForgetCompressedPage(const PageEntry& ent);
+	
+	// Accounts for a copy of an entry, made when cloning a page mapping. Each copy is forgotten separately.
+	// Entries that don't hold a compressed page are ignored.
+	void CopyCompressedPage(const PageEntry& ent);
+	
+	// Allocates a zeroed page to hold a paging structure. Returns PMM::INVALID_PAGE if we're out of memory.
+	uintptr_t AllocatePageTable();
+	
+	// Starts keeping track of a page that was allocated by other means to hold a paging structure.
+	// Its entries must all be zero.
+	void TrackPageTable(uintptr_t page);
+	
+	// Stops keeping track of a page that held a paging structure, before it's freed.
+	void UntrackPageTable(uintptr_t page);
+	
+	// Stops keeping track of a page that held a paging structure, and frees it.
+	void FreePageTable(uintptr_t page);
+	
+	// Gets the number of pages that hold paging structures.
+	uint64_t GetPageTablePages();
+	
+	// Sets the contents of an entry in a PML3, page directory or page table, keeping count of the
+	// entries in use in the structure's page frame.
+	void SetEntry(PageEntry& ent, uint64_t data);
+	
 	// Represents a single page entry.
 	union PageEntry
 	{
@@ -124,16 +414,17 @@ namespace VMM
 			bool m_cacheDisable  : 1; // bit 4
 			bool m_accessed      : 1; // bit 5
 			bool m_dirty         : 1; // bit 6
-			bool m_pat           : 1; // bit 7
+			bool m_pat           : 1; // bit 7: PAT in page table entries, page size in page directory entries
 			bool m_global        : 1; // bit 8
 			// 3 available bits.
 			bool m_partOfPmm     : 1; // bit 9:  If this bit is set, this is a part of the PMM.
 			bool m_needAllocPage : 1; // bit 10: If this bit is set, we will want to place a new address into the address field on page fault.
 			                          //         When we do that, we should fill it with a byte like (protKey << 4 | protKey). No particular
-									  //         reason we are using protKey specifically.
-			bool m_available0    : 1; // bit 11
+									  //         reason we are using protKey specifically. Compressed pages keep their byte in the address
+									  //         field instead, see C_COMPRESSED_PAGE_MARK.
+			bool m_copyOnWrite   : 1; // bit 11: If this bit is set, the page is shared read-only, and must be copied when written to.
 			uint64_t m_address   : 40;// bits 12-51 (MAXPHYADDR)
-			int  m_available1    : 7; // bits 52-58 (ignored)
+			int  m_faultAround   : 7; // bits 52-58: If m_needAllocPage is set, how many of the following pages to allocate along with this one.
 			int  m_protKey       : 4; // bits 59-62 (protection key, ignores unless CR4.PKE or CR4.PKS is set and this is a page tree leaf)
 			bool m_execDisable   : 1; // bit 63: Disable execution from this page.
 		};
@@ -183,19 +474,29 @@ namespace VMM
 			return &m_entries[index];
 		}
 		
-		// Clone the page table.
-		PageTable* Clone();
+		// Clone the page table. The pages themselves are shared, and copied on write.
+		PageTable* Clone(PMM::PageBatch& batch, bool& bModified);
 	};
 	
 	struct PageDirectory
 	{
 		PageEntry m_entries[512];
 		
-		// Gets the page table pointer as a virtual address.
+		// Gets the page table pointer as a virtual address. Returns NULL if the entry maps a huge page.
 		PageTable* GetPageTable(int index);
 		
+		// Gets the page table pointer as a virtual address, allocating one if there's none. Returns NULL if the
+		// entry maps a huge page, or if we're out of memory.
+		PageTable* GetOrAllocPageTable(int index);
+		
+		// Checks if an entry maps a huge page.
+		bool IsHugePage(int index) const
+		{
+			return m_entries[index].m_present && (m_entries[index].m_data & PE_PAGESIZE);
+		}
+		
 		// Clones the page directory.
-		PageDirectory* Clone();
+		PageDirectory* Clone(PMM::PageBatch& batch, bool& bModified);
 	};
 	
 	struct PML3 // PDPT
@@ -206,7 +507,7 @@ namespace VMM
 		PageDirectory* GetPageDirectory(int index);
 		
 		// Clones the PML3.
-		PML3* Clone();
+		PML3* Clone(PMM::PageBatch& batch, bool& bModified);
 	};
 	
 	struct PageMapping
@@ -219,46 +520,146 @@ namespace VMM
 		// Gets the PML3 pointer as a virtual address.
 		PML3* GetPML3(int index);
 		
-		// Clones a page mapping.
+		// Gets the page directory an address resides in. Returns NULL if there's none.
+		PageDirectory* GetPageDirectory(uintptr_t addr);
+		
+		// Gets the page directory an address resides in, allocating the levels above it if needed.
+		PageDirectory* GetOrAllocPageDirectory(uintptr_t addr);
+		
+		// Clones a page mapping. The lower half's pages are shared, and copied on write.
 		PageMapping* Clone(bool keepLowerHalf = true);
 		
 		// Gets a page entry from the table. Returns NULL if it's not available.
-		PageEntry* GetPageEntry(uintptr_t addr);
+		// If the address is part of a huge page, the page directory entry is returned, and pbHuge is set.
+		PageEntry* GetPageEntry(uintptr_t addr, bool* pbHuge = nullptr);
 		
 		// Switches the executing CPU to use this page mapping.
 		void SwitchTo();
 		
+		// Gets the generation of this page mapping. Each CPU keeps the TLB entries it cached for the mapping
+		// under its PCID, for as long as the generation stays the same.
+		uint64_t GetGeneration();
+		
+		// Gives this page mapping a new generation, so that every CPU flushes its entries before using it again.
+		void BumpGeneration();
+		
+		// Flushes changed entries of this page mapping from the TLB. If the range is in the lower half, and this
+		// isn't the current page mapping, the mapping's generation is bumped instead.
+		void FlushTLB(uintptr_t addr, size_t pageCount = 1);
+		
 		// Set a page mapping's page entry at a particular address.
 		bool MapPage(uintptr_t addr, const PageEntry & pe);
 		
 		// Map a new page in. For now, not demand paged -- we need to wait until we add interrupts.
 		bool MapPage(uintptr_t addr, bool rw = true, bool super = false, bool xd = true);
 		
+		// Maps a range of demand paged, zero filled pages. When one of them is faulted in, up to 'faultAround'
+		// of the pages that follow it in the same page table are allocated along with it, in a single batch.
+		bool MapDemandPages(uintptr_t addr, size_t pageCount, bool rw = true, bool super = false, bool xd = true, int faultAround = 0);
+		
+		// Looks for pages in the lower half that are filled with a single byte, and compresses them into their page
+		// entry, freeing the page. They're brought back when accessed. Up to 'pageCount' entries are looked at, starting
+		// from 'cursor', which is advanced past them. Recently accessed pages are skipped. This mapping must be the current
+		// one. Returns false once the end of the lower half is reached, in which case the cursor wraps around.
+		bool CompressPages(uintptr_t& cursor, size_t pageCount);
+		
 		// Removes a page mapping, and any now empty levels that it resided in.
+		// If the page is part of a huge page, the huge page is split up first.
 		void UnmapPage(uintptr_t addr, bool removeUpperLevels = true);
+		
+		// Set a page mapping's page directory entry at a particular 2 MB aligned address. Anything mapped there before is unmapped.
+		bool MapHugePage(uintptr_t addr, const PageEntry & pe);
+		
+		// Map a new, zeroed, 2 MB page in. Returns false if the address isn't aligned or there's no 2 MB block of memory free.
+		bool MapHugePage(uintptr_t addr, bool rw = true, bool super = false, bool xd = true);
+		
+		// Removes the 2 MB of mappings at a particular 2 MB aligned address, be it a huge page or a page table.
+		void UnmapHugePage(uintptr_t addr);
+		
+		// Splits a huge page up into a page table with the same mappings. Returns false if we're out of memory.
+		bool SplitHugePage(uintptr_t addr);
+		
+		// Detaches the page table, page directory and PML3 an address resides in, if they're empty. The PML3s
+		// of the kernel half are shared with every page mapping, so they are never detached. The detached
+		// tables are written to pTables, and must be freed once they have been flushed out of the TLB.
+		// Returns the number of detached tables.
+		int DetachEmptyLevels(uintptr_t addr, uintptr_t pTables[3]);
+		
+		// Maps a range of pages with copies of a page entry. If bContiguous is set, the address of the entry
+		// is advanced by a page for each page, so that a physically contiguous range is mapped. Anything
+		// mapped in the range before is unmapped. Returns false if we're out of memory, in which case the
+		// pages mapped so far stay mapped.
+		bool MapRange(uintptr_t addr, size_t pageCount, const PageEntry & pe, bool bContiguous = false);
+		
+		// Removes the mappings of a range of pages. Page tables that the range covers entirely are freed.
+		void UnmapRange(uintptr_t addr, size_t pageCount);
+		
+		// Changes the access and caching flags of the pages mapped in a range. The flags in 'clear' are removed,
+		// then the ones in 'set' are added. Shared pages that are made writable become copy on write instead.
+		void ProtectRange(uintptr_t addr, size_t pageCount, uint64_t set, uint64_t clear);
 	};
 	
+	// Reserves the kernel virtual address region's PML3, so that every CPU's page mapping shares it.
+	// Must be called on the bootstrap CPU, before the page mapping is cloned.
+	void InitVirtualRegion();
+	
+	// Allocates a range of kernel virtual memory, backed by pages that don't have to be physically
+	// contiguous. Each range is followed by an unmapped guard page, so the page below a range is never
+	// mapped either. If bDemandPaged is set, pages are only allocated once they're first touched.
+	// Returns NULL if we're out of memory.
+	void* AllocateVirtual(size_t size, bool bDemandPaged = false);
+	
+	// Frees a range returned by AllocateVirtual. The range is unmapped right away, but its pages and
+	// addresses are only reused once enough ranges have been freed to flush them from the TLB in one go.
+	void FreeVirtual(void* pMem);
+	
+	// Flushes the freed kernel virtual address ranges from the TLB, and frees their pages and addresses.
+	void PurgeVirtual();
+	
+	// The memory types a mapping can have. Each one selects an entry of the PAT, which Arch::InitPAT
+	// programs the same way on every CPU.
+	enum eMemoryType
+	{
+		MT_WRITEBACK,    // PAT entry 0
+		MT_WRITETHROUGH, // PAT entry 1
+		MT_UNCACHED,     // PAT entry 3
+		MT_WRITECOMBINE, // PAT entry 4
+	};
+	
+	// Gets the page table entry flags that select a memory type.
+	uint64_t GetMemoryTypeFlags(eMemoryType type);
+	
+	// Maps a range of physical memory, such as device registers or a framebuffer, into the kernel virtual
+	// address region with a certain memory type. The address doesn't have to be page aligned. Returns NULL
+	// if we're out of address space.
+	void* MapMMIO(uintptr_t phys, size_t size, eMemoryType type = MT_UNCACHED);
+	
+	// Unmaps a range mapped with MapMMIO.
+	void UnmapMMIO(void* pMem);
+	
 	class KernelHeap
 	{
 	public:
-		struct FreeListNode
+		// The header in front of every block. The blocks are laid out back to back, so that
+		// each one can reach its neighbours without searching.
+		struct alignas(16) Block
 		{
 			static constexpr uint64_t FLN_MAGIC = 0x67249a80d35b1cef;
 			static constexpr uint64_t FLA_MAGIC = 0x4fa850d3672e91cb;
 			
-			uint64_t      m_magic;
-			FreeListNode* m_next;
-			FreeListNode* m_prev;
-			size_t        m_size;
+			uint64_t m_magic;
+			size_t   m_size;
+			Block*   m_prevPhys; // The block right before this one, or NULL if this is the first.
+			void*    m_callSite; // The code that allocated this block, if the heap is being profiled.
 			
 			void* GetArea()
 			{
-				return (void*)((uint8_t*)this + sizeof(FreeListNode));
+				return (void*)((uint8_t*)this + sizeof(Block));
 			}
 			
-			FreeListNode* GetPtrDirectlyAfter()
+			Block* GetPtrDirectlyAfter()
 			{
-				return (FreeListNode*)((uint8_t*)this + sizeof(FreeListNode) + m_size);
+				return (Block*)((uint8_t*)this + sizeof(Block) + m_size);
 			}
 		};
 		
@@ -266,9 +667,75 @@ namespace VMM
 		// Initializes the kernel heap.
 		static void Init();
 		
-		static void* Allocate(size_t);
+		// The call site is what the profiler charges the block to. If it's NULL, the caller is charged.
+		static void* Allocate(size_t, void* pCallSite = nullptr);
+		
+		// Allocates a block whose address is a multiple of an alignment, which must be a power of two.
+		static void* AllocateAligned(size_t, size_t align, void* pCallSite = nullptr);
+		
+		// Resizes a block, in place if possible. Returns NULL, and leaves the block alone, if we're out of memory.
+		static void* Reallocate(void*, size_t, void* pCallSite = nullptr);
 		
 		static void Free(void*);
+		
+		// Releases the free chunks at the end of the kernel heap back to the PMM.
+		static void Trim();
+		
+		// Logs how much of the heap each call site is holding on to, biggest first. This only
+		// works if PROFILE_KERNEL_HEAP is defined in KernelHeap.cpp.
+		static void DumpProfile();
+	};
+	
+	// Hands out small blocks from slabs, with one cache per power of two size class. A slab is a block
+	// of pages taken straight from the PMM, with a bitmap of the objects in use.
+	class SlabAllocator
+	{
+	public:
+		// The smallest and largest sizes served by the slabs. Anything larger goes to the kernel heap.
+		static constexpr size_t C_MIN_SIZE = 16;
+		static constexpr size_t C_MAX_SIZE = 2048;
+		
+		// The amount of size classes. (16, 32, ..., 2048)
+		static constexpr int C_SIZE_CLASS_COUNT = 8;
+		
+		// Allocates a block of up to C_MAX_SIZE bytes, aligned to 16 bytes, from the current CPU's arena.
+		// Returns NULL if we're out of memory.
+		static void* Allocate(size_t);
+		
+		// Frees a block. If it belongs to another CPU's arena, it's handed back to that CPU.
+		// Returns false if the block doesn't belong to a slab.
+		static bool Free(void*);
+	};
+	
+	struct Slab;
+	struct SlabArena;
+	
+	// The slabs of a single size class.
+	struct SlabCache
+	{
+		SlabArena* m_pArena;
+		size_t     m_objSize;
+		size_t     m_objCount;
+		
+		// The slabs with at least one object in use and one free. Full slabs aren't kept in any list.
+		Slab*      m_pPartial;
+		
+		// An entirely free slab, kept around so that a single object being allocated and freed over
+		// and over doesn't keep going to the PMM.
+		Slab*      m_pEmpty;
+	};
+	
+	// The slab caches owned by a single CPU. Only the owner touches them, with interrupts disabled, so no
+	// locks are needed. Other CPUs push the blocks they free onto the remote free list instead, which the
+	// owner drains on its next allocation.
+	struct SlabArena
+	{
+		SlabCache m_caches[SlabAllocator::C_SIZE_CLASS_COUNT];
+		
+		// The blocks freed by other CPUs, linked through their first 8 bytes.
+		Atomic<void*> m_remoteFree;
+		
+		SlabArena();
 	};
 }
 
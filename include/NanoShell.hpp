@@ -33,6 +33,21 @@ constexpr nopanic_t nopanic;
 void* operator new(size_t, const nopanic_t&);
 void* operator new[](size_t, const nopanic_t&);
 
+// The compiler passes this to the allocation functions of over-aligned types. We don't have <new>, so declare it ourselves.
+namespace std
+{
+	enum class align_val_t : size_t {};
+}
+
+void* operator new(size_t, std::align_val_t);
+void* operator new[](size_t, std::align_val_t);
+void* operator new(size_t, std::align_val_t, const nopanic_t&);
+void* operator new[](size_t, std::align_val_t, const nopanic_t&);
+void  operator delete(void*, std::align_val_t);
+void  operator delete[](void*, std::align_val_t);
+void  operator delete(void*, size_t, std::align_val_t);
+void  operator delete[](void*, size_t, std::align_val_t);
+
 #define ASM __asm__ __volatile__
 
 #ifdef TARGET_X86_64
@@ -45,6 +45,12 @@ class Scheduler
 	// Maximum time slice for a thread.
 	constexpr static uint64_t C_THREAD_MAX_TIME_SLICE = 1'000'000;
 	
+	// The amount of pages the idle thread zeroes before checking whether it should halt.
+	constexpr static size_t C_IDLE_ZERO_BATCH = 16;
+	
+	// The amount of page entries the idle thread looks at for compression before checking whether it should halt.
+	constexpr static size_t C_IDLE_COMPRESS_BATCH = 512;
+	
 public:
 	// Creates a new thread object.
 	Thread* CreateThread();
@@ -85,6 +91,7 @@ private:
 	static void IdleThread();
 	static void NormalThread();
 	static void RealTimeThread();
+	static void ShortLivedThread();
 	
 	void DeleteThread(Thread* pThread);
 	
@@ -94,7 +101,8 @@ private:
 	// For each suspended thread, check if it's suspended anymore.
 	void CheckUnsuspensionConditions();
 	
-	// Kill every zombie thread that isn't owned by anybody.
+	// Kill every zombie thread that isn't owned by anybody. This is run by the idle thread, since freeing a
+	// thread's stack takes locks that an interrupted thread may be holding.
 	void CheckZombieThreads();
 	
 	// Check for sleeping threads that need to wake up.
@@ -19,6 +19,9 @@ namespace Terminal
 	// Called when the kernel first starts up. Checks Limine's response field.
 	bool CheckResponse();
 	
+	// Maps the framebuffer again as write combining, once the virtual memory manager is up.
+	void RemapFramebuffer();
+	
 	// Writes a string to the terminal.
 	void Write(const char * str);
 	
@@ -182,7 +182,7 @@ protected:
 	ThreadEntry m_EntryPoint;
 	
 	// The stack of this thread.
-	uint64_t* m_pStack;
+	uint64_t* m_pStack = nullptr;
 	size_t    m_StackSize = 32768;
 	
 	// The time the thread will wake up:
@@ -17,6 +17,15 @@
 //      If page alignment is required we usually only need to
 //   allocate one page at a time, so use the PMM directly + the
 //   HHDM mapping.
+//      Free blocks are kept in bins indexed by two levels of
+//   bitmaps (a two level segregated fit allocator), so finding a
+//   block that fits takes constant time. Every block knows where
+//   the one before it starts, so freeing one merges it with its
+//   neighbours in constant time too.
+//      The heap's address range is reserved up front, but only
+//   committed in chunks as it runs out of space. Free chunks at
+//   the end are given back to the PMM once enough of them pile
+//   up.
 //
 //  ***************************************************************
 #include <Arch.hpp>
@@ -24,147 +33,750 @@
 
 #define DEBUG_KERNEL_HEAP
 
+// Keeps track of how much each call site has allocated. See KernelHeap::DumpProfile.
+//#define PROFILE_KERNEL_HEAP
+
 using namespace VMM;
 
+using Block = KernelHeap::Block;
+
+// The free blocks are binned by size. The first level splits the sizes into powers of two, and the
+// second level splits each power of two into 16 evenly sized bins. Sizes below 256 bytes all go into
+// first level bin 0, whose second level bins are 16 bytes apart.
+constexpr int    C_ALIGN_LOG2 = 4;
+constexpr int    C_SL_LOG2    = 4;
+constexpr int    C_SL_COUNT   = 1 << C_SL_LOG2;
+constexpr int    C_FL_SHIFT   = C_SL_LOG2 + C_ALIGN_LOG2 - 1;
+constexpr int    C_FL_COUNT   = 32;
+constexpr size_t C_SMALL_SIZE = 1ULL << (C_SL_LOG2 + C_ALIGN_LOG2);
+
+static_assert(C_KERNEL_HEAP_MAX_SIZE < (1ULL << (C_FL_COUNT + C_FL_SHIFT)), "The kernel heap is too large for its bins");
+
+// A free block keeps the links to its neighbours in the bin inside of its area.
+struct FreeLinks
+{
+	Block* m_next;
+	Block* m_prev;
+};
+
+// The smallest area a block may have, so that it can hold its links once it's freed.
+constexpr size_t C_MIN_AREA = sizeof(FreeLinks);
+
+static_assert(sizeof(Block) % (1 << C_ALIGN_LOG2) == 0, "Block headers must keep the areas aligned");
+
 static Spinlock s_KernelHeapLock;
 
-static KernelHeap::FreeListNode *s_FLStart, *s_FLEnd;
+// A set bit in the first level bitmap means that the respective second level bitmap isn't empty.
+static uint32_t s_FLBitmap;
+static uint32_t s_SLBitmap[C_FL_COUNT];
+static Block*   s_FreeLists[C_FL_COUNT][C_SL_COUNT];
 
-void KernelHeap::Init()
+// The block at the end of the heap.
+static Block* s_LastBlock;
+
+// The end of the committed part of the kernel heap.
+static uintptr_t s_HeapEnd;
+
+// The end of the chunks past s_HeapEnd that are being released with the lock dropped, or 0 if there are none.
+static Atomic<uintptr_t> s_ReleaseEnd;
+
+// Once this much free space piles up at the end of the heap, it's trimmed, leaving one chunk behind
+// so that an allocation hovering around the boundary doesn't commit and release the same chunk forever.
+constexpr size_t C_TRIM_THRESHOLD = 4 * C_KERNEL_HEAP_CHUNK_SIZE;
+constexpr size_t C_TRIM_KEEP      = C_KERNEL_HEAP_CHUNK_SIZE;
+
+#ifdef PROFILE_KERNEL_HEAP
+
+// The number of call sites the profiler keeps track of, and how far we look for one in the table.
+// Call sites that don't make it in are lumped together.
+constexpr int    C_PROFILE_SITES_LOG2 = 10;
+constexpr size_t C_PROFILE_SITES      = 1ULL << C_PROFILE_SITES_LOG2;
+constexpr size_t C_PROFILE_MAX_PROBES = 32;
+
+struct ProfileSite
 {
-	LockGuard lg(s_KernelHeapLock);
+	void*  m_callSite;
+	size_t m_liveBytes;
+	size_t m_liveCount;
+	size_t m_allocCount;
+	size_t m_peakBytes;
+};
+
+static ProfileSite s_ProfileSites[C_PROFILE_SITES];
+static ProfileSite s_ProfileOthers;
+
+// Where DumpProfile copies the table to, so that it can sort it without holding the heap's lock.
+static ProfileSite s_ProfileSnapshot[C_PROFILE_SITES + 1];
+static Spinlock    s_ProfileSnapshotLock;
+
+// Gets the entry of a call site, adding it if it's not there. Must be called with the lock held.
+static ProfileSite* GetProfileSite(void* pCallSite)
+{
+	size_t index = ((uintptr_t)pCallSite * 0x9E3779B97F4A7C15ULL) >> (64 - C_PROFILE_SITES_LOG2);
+	
+	for (size_t i = 0; i < C_PROFILE_MAX_PROBES; i++)
+	{
+		ProfileSite& site = s_ProfileSites[(index + i) % C_PROFILE_SITES];
+		
+		if (site.m_callSite == pCallSite)
+			return &site;
+		
+		if (!site.m_callSite)
+		{
+			site.m_callSite = pCallSite;
+			return &site;
+		}
+	}
+	
+	return &s_ProfileOthers;
+}
+
+// Charges the size of a block to a call site. Must be called with the lock held.
+static void ProfileAllocated(Block* pBlock, void* pCallSite)
+{
+	pBlock->m_callSite = pCallSite;
+	
+	ProfileSite* pSite = GetProfileSite(pCallSite);
+	pSite->m_liveBytes += pBlock->m_size;
+	pSite->m_liveCount++;
+	pSite->m_allocCount++;
+	
+	if (pSite->m_peakBytes < pSite->m_liveBytes)
+		pSite->m_peakBytes = pSite->m_liveBytes;
+}
+
+// Charges the change in size of a block to the call site that allocated it. Must be called with the lock held.
+static void ProfileResized(Block* pBlock, size_t oldSize)
+{
+	ProfileSite* pSite = GetProfileSite(pBlock->m_callSite);
+	pSite->m_liveBytes += pBlock->m_size - oldSize;
+	
+	if (pSite->m_peakBytes < pSite->m_liveBytes)
+		pSite->m_peakBytes = pSite->m_liveBytes;
+}
+
+// Must be called with the lock held.
+static void ProfileFreed(Block* pBlock)
+{
+	ProfileSite* pSite = GetProfileSite(pBlock->m_callSite);
+	pSite->m_liveBytes -= pBlock->m_size;
+	pSite->m_liveCount--;
+}
+
+#else
+
+static void ProfileAllocated(UNUSED Block* pBlock, UNUSED void* pCallSite) {}
+static void ProfileResized(UNUSED Block* pBlock, UNUSED size_t oldSize) {}
+static void ProfileFreed(UNUSED Block* pBlock) {}
+
+#endif
+
+static FreeLinks* GetLinks(Block* pBlock)
+{
+	return (FreeLinks*)pBlock->GetArea();
+}
+
+// Gets the block right after this one, or NULL if this is the last one.
+static Block* GetNextBlock(Block* pBlock)
+{
+	if (pBlock == s_LastBlock)
+		return nullptr;
+	
+	return pBlock->GetPtrDirectlyAfter();
+}
+
+// Gets the index of the highest set bit.
+static int FindLastSet(size_t size)
+{
+	return 63 - __builtin_clzll(size);
+}
+
+// Gets the bin that blocks of a certain size go in.
+static void MapSize(size_t size, int& fl, int& sl)
+{
+	if (size < C_SMALL_SIZE)
+	{
+		fl = 0;
+		sl = int(size >> C_ALIGN_LOG2);
+		return;
+	}
+	
+	int bit = FindLastSet(size);
+	fl = bit - C_FL_SHIFT;
+	sl = int(size >> (bit - C_SL_LOG2)) ^ C_SL_COUNT;
+}
+
+static void InsertFreeBlock(Block* pBlock)
+{
+	int fl, sl;
+	MapSize(pBlock->m_size, fl, sl);
+	
+	FreeLinks* pLinks = GetLinks(pBlock);
+	pLinks->m_prev = nullptr;
+	pLinks->m_next = s_FreeLists[fl][sl];
+	
+	if (pLinks->m_next)
+		GetLinks(pLinks->m_next)->m_prev = pBlock;
+	
+	s_FreeLists[fl][sl] = pBlock;
+	s_SLBitmap[fl] |= 1U << sl;
+	s_FLBitmap     |= 1U << fl;
+}
+
+static void RemoveFreeBlock(Block* pBlock)
+{
+	int fl, sl;
+	MapSize(pBlock->m_size, fl, sl);
+	
+	FreeLinks* pLinks = GetLinks(pBlock);
+	
+	if (pLinks->m_prev)
+		GetLinks(pLinks->m_prev)->m_next = pLinks->m_next;
+	else
+		s_FreeLists[fl][sl] = pLinks->m_next;
+	
+	if (pLinks->m_next)
+		GetLinks(pLinks->m_next)->m_prev = pLinks->m_prev;
+	
+	if (!s_FreeLists[fl][sl])
+	{
+		s_SLBitmap[fl] &= ~(1U << sl);
+		if (!s_SLBitmap[fl])
+			s_FLBitmap &= ~(1U << fl);
+	}
+}
+
+// Finds a free block that can fit a certain size, without searching. Returns NULL if there's none.
+static Block* FindFreeBlock(size_t size)
+{
+	// Round the size up to the next bin, so that any block in the bin we land on fits.
+	if (size >= C_SMALL_SIZE)
+		size += (1ULL << (FindLastSet(size) - C_SL_LOG2)) - 1;
+	
+	int fl, sl;
+	MapSize(size, fl, sl);
+	
+	if (fl >= C_FL_COUNT)
+		return nullptr;
+	
+	uint32_t slMap = s_SLBitmap[fl] & (~0U << sl);
+	if (!slMap)
+	{
+		// Nothing in this power of two, so take the smallest bin of the next non empty one.
+		uint32_t flMap = fl + 1 < C_FL_COUNT ? s_FLBitmap & (~0U << (fl + 1)) : 0;
+		if (!flMap)
+			return nullptr;
+		
+		fl = __builtin_ctz(flMap);
+		slMap = s_SLBitmap[fl];
+	}
+	
+	sl = __builtin_ctz(slMap);
+	return s_FreeLists[fl][sl];
+}
+
+// Merges a block with the one right after it. The blocks must not be in the bins.
+static void AbsorbNextBlock(Block* pBlock, Block* pNext)
+{
+	pBlock->m_size += sizeof(Block) + pNext->m_size;
+	pNext->m_magic = 0;
+	
+	if (pNext == s_LastBlock)
+		s_LastBlock = pBlock;
+	else
+		pBlock->GetPtrDirectlyAfter()->m_prevPhys = pBlock;
+}
+
+// Cuts a block down to a certain size, and puts the remainder in the bins, if it's big enough to be a block.
+// The remainder is merged with the block after it, if that one's free.
+static void SplitBlock(Block* pBlock, size_t size)
+{
+	if (pBlock->m_size < size + sizeof(Block) + C_MIN_AREA)
+		return;
+	
+	Block* pRest = (Block*)((uint8_t*)pBlock->GetArea() + size);
+	pRest->m_magic    = Block::FLN_MAGIC;
+	pRest->m_size     = pBlock->m_size - size - sizeof(Block);
+	pRest->m_prevPhys = pBlock;
+	
+	pBlock->m_size = size;
+	
+	if (pBlock == s_LastBlock)
+		s_LastBlock = pRest;
+	else
+		pRest->GetPtrDirectlyAfter()->m_prevPhys = pRest;
 	
+	Block* pNext = GetNextBlock(pRest);
+	if (pNext && pNext->m_magic == Block::FLN_MAGIC)
+	{
+		RemoveFreeBlock(pNext);
+		AbsorbNextBlock(pRest, pNext);
+	}
+	
+	InsertFreeBlock(pRest);
+}
+
+// Cuts the start of a free block off, so that the rest starts at a certain address, and puts the start back in the bins.
+// The block must not be in the bins. Returns the rest.
+static Block* SplitBlockFront(Block* pBlock, uintptr_t areaAddr)
+{
+	Block* pRest = (Block*)areaAddr - 1;
+	pRest->m_magic    = Block::FLN_MAGIC;
+	pRest->m_size     = (uintptr_t)pBlock->GetPtrDirectlyAfter() - areaAddr;
+	pRest->m_prevPhys = pBlock;
+	
+	pBlock->m_size = (uintptr_t)pRest - (uintptr_t)pBlock->GetArea();
+	
+	if (pBlock == s_LastBlock)
+		s_LastBlock = pRest;
+	else
+		pRest->GetPtrDirectlyAfter()->m_prevPhys = pRest;
+	
+	InsertFreeBlock(pBlock);
+	return pRest;
+}
+
+// Commits a chunk of the kernel heap. Use a huge page where possible, and fall back to single pages otherwise.
+// The pages are allocated right away instead of being demand paged, so that using the heap never has to fault
+// memory in. If this fails, the part that was mapped is left for the caller to unmap.
+static bool CommitChunk(uintptr_t addr)
+{
 	PageMapping* pPM = PageMapping::GetFromCR3();
 	
-	// map the kernel heap in.
-	for (uint64_t i = 0; i < C_KERNEL_HEAP_SIZE; i += PAGE_SIZE)
+	if (pPM->MapHugePage(addr, true, true))
+		return true;
+	
+	constexpr uint64_t C_CHUNK_FLAGS = PE_PRESENT | PE_READWRITE | PE_SUPERVISOR | PE_EXECUTEDISABLE | PE_PARTOFPMM;
+	constexpr size_t   C_CHUNK_PAGES = C_KERNEL_HEAP_CHUNK_SIZE / PAGE_SIZE;
+	
+	// Allocate the pages in batches, and map them in.
+	uintptr_t pages[64];
+	for (size_t done = 0; done < C_CHUNK_PAGES; )
 	{
-		pPM->MapPage(C_KERNEL_HEAP_START + i, true, true);
+		size_t want = C_CHUNK_PAGES - done;
+		if (want > 64)
+			want = 64;
+		
+		size_t got = PMM::AllocatePages(want, pages), mapped = 0;
+		
+		while (mapped < got && pPM->MapPage(addr + (done + mapped) * PAGE_SIZE, PageEntry(pages[mapped], C_CHUNK_FLAGS, 0)))
+			mapped++;
+		
+		done += mapped;
+		
+		if (mapped < want)
+		{
+			PMM::FreePages(pages + mapped, got - mapped);
+			return false;
+		}
 	}
 	
-	// setup the first free list block
-	s_FLStart = (FreeListNode*)C_KERNEL_HEAP_START;
-	s_FLStart->m_magic = FreeListNode::FLN_MAGIC;
-	s_FLStart->m_size  = C_KERNEL_HEAP_SIZE - sizeof(FreeListNode);
-	s_FLStart->m_next  = nullptr;
-	s_FLStart->m_prev  = nullptr;
-	s_FLEnd = s_FLStart;
+	return true;
 }
 
-void* KernelHeap::Allocate(size_t sz)
+// Waits until the chunks being released by another CPU are unmapped. Must be called with the lock held. The lock
+// is dropped meanwhile, and our share of the TLB shootdown is carried out, since that CPU is waiting for it.
+static void WaitForRelease()
 {
-	// align our size to 16 bytes.
-	sz = (sz + 15) & ~15;
+	if (!s_ReleaseEnd.Load())
+		return;
 	
-	LockGuard lg(s_KernelHeapLock);
+	s_KernelHeapLock.Unlock();
 	
-	FreeListNode* pNode = s_FLStart;
-	FreeListNode* pBFN = nullptr;
-	while (pNode)
+	while (s_ReleaseEnd.Load())
 	{
-		// skip any candidate that won't fit our size...
-		if (pNode->m_size < sz)
+		Arch::CPU* pCpu = Arch::CPU::GetCurrent();
+		if (pCpu)
 		{
-			pNode = pNode->m_next;
-			continue;
+			bool bState = pCpu->SetInterruptsEnabled(false);
+			Arch::TLB::ProcessQueue();
+			pCpu->SetInterruptsEnabled(bState);
 		}
 		
-		// or isn't free
-		if (pNode->m_magic != FreeListNode::FLN_MAGIC)
+		Spinlock::SpinHint();
+	}
+	
+	s_KernelHeapLock.Lock();
+}
+
+// Unmaps chunks past the end of the heap. Must be called with the lock held. The lock is dropped while they're unmapped,
+// since another CPU may be spinning on it with interrupts disabled, and would never carry out the TLB shootdown.
+static void ReleaseChunks(uintptr_t start, uintptr_t end)
+{
+	s_ReleaseEnd.Store(end);
+	s_KernelHeapLock.Unlock();
+	
+	PageMapping::GetFromCR3()->UnmapRange(start, (end - start) / PAGE_SIZE);
+	
+	s_ReleaseEnd.Store(0);
+	s_KernelHeapLock.Lock();
+}
+
+// Commits enough chunks at the end of the heap that the last block is free and fits an allocation.
+// Must be called with the lock held.
+static bool GrowHeap(size_t sz)
+{
+	// The heap can't grow back into chunks that are still being released.
+	WaitForRelease();
+	
+	bool bLastFree = s_LastBlock->m_magic == Block::FLN_MAGIC;
+	if (bLastFree && s_LastBlock->m_size >= sz)
+		return true;
+	
+	// If the last block isn't free, a new block has to be created for the new space.
+	size_t need = bLastFree ? sz - s_LastBlock->m_size : sz + sizeof(Block);
+	
+	size_t growBy = (need + C_KERNEL_HEAP_CHUNK_SIZE - 1) & ~(C_KERNEL_HEAP_CHUNK_SIZE - 1);
+	if (s_HeapEnd + growBy > C_KERNEL_HEAP_START + C_KERNEL_HEAP_MAX_SIZE)
+		return false;
+	
+	for (size_t i = 0; i < growBy; i += C_KERNEL_HEAP_CHUNK_SIZE)
+	{
+		if (!CommitChunk(s_HeapEnd + i))
 		{
-			#ifdef DEBUG_KERNEL_HEAP
-			// make sure that our kernel heap ain't corrupted or anything
-			if (pNode->m_magic != FreeListNode::FLA_MAGIC)
-			{
-				SLogMsg("ERROR: kernel heap corruption detected at %p. Magic: %p. RA: %p", pNode, pNode->m_magic, __builtin_return_address(0));
-			}
-			#endif
-			
-			pNode = pNode->m_next;
-			continue;
+			// Give back what we managed to commit, including the part of the chunk that failed.
+			ReleaseChunks(s_HeapEnd, s_HeapEnd + i + C_KERNEL_HEAP_CHUNK_SIZE);
+			return false;
 		}
+	}
+	
+	if (bLastFree)
+	{
+		RemoveFreeBlock(s_LastBlock);
+		s_LastBlock->m_size += growBy;
+		InsertFreeBlock(s_LastBlock);
+	}
+	else
+	{
+		Block* pBlock = (Block*)s_HeapEnd;
+		pBlock->m_magic    = Block::FLN_MAGIC;
+		pBlock->m_size     = growBy - sizeof(Block);
+		pBlock->m_prevPhys = s_LastBlock;
+		s_LastBlock = pBlock;
+		InsertFreeBlock(pBlock);
+	}
+	
+	s_HeapEnd += growBy;
+	return true;
+}
+
+// Releases the free chunks at the end of the heap, except for the amount we want to keep. Must be called with the lock held,
+// which is dropped while they're unmapped.
+static void TrimHeap(size_t keep)
+{
+	// Another CPU is already releasing chunks, and the heap can't shrink below them until it's done.
+	if (s_ReleaseEnd.Load() || s_LastBlock->m_magic != Block::FLN_MAGIC)
+		return;
+	
+	uintptr_t areaStart = (uintptr_t)s_LastBlock->GetArea();
+	uintptr_t releaseFrom = (areaStart + keep + C_MIN_AREA + C_KERNEL_HEAP_CHUNK_SIZE - 1) & ~(C_KERNEL_HEAP_CHUNK_SIZE - 1);
+	
+	// Never release the initial part of the heap.
+	if (releaseFrom < C_KERNEL_HEAP_START + C_KERNEL_HEAP_INITIAL_SIZE)
+		releaseFrom = C_KERNEL_HEAP_START + C_KERNEL_HEAP_INITIAL_SIZE;
+	
+	if (releaseFrom >= s_HeapEnd)
+		return;
+	
+	RemoveFreeBlock(s_LastBlock);
+	
+	s_LastBlock->m_size = releaseFrom - areaStart;
+	
+	InsertFreeBlock(s_LastBlock);
+	
+	// Nothing can reach the chunks past the last block anymore, so they can be unmapped without the lock.
+	uintptr_t releaseEnd = s_HeapEnd;
+	s_HeapEnd = releaseFrom;
+	
+	ReleaseChunks(releaseFrom, releaseEnd);
+}
+
+void KernelHeap::Init()
+{
+	LockGuard lg(s_KernelHeapLock);
+	
+	// map the initial part of the kernel heap in. This also makes sure that the heap's PML3 exists before the
+	// kernel half of the page mapping is copied.
+	for (uintptr_t i = 0; i < C_KERNEL_HEAP_INITIAL_SIZE; i += C_KERNEL_HEAP_CHUNK_SIZE)
+	{
+		if (!CommitChunk(C_KERNEL_HEAP_START + i))
+			KernelPanic("Could not commit the initial kernel heap");
+	}
+	
+	s_HeapEnd = C_KERNEL_HEAP_START + C_KERNEL_HEAP_INITIAL_SIZE;
+	
+	// setup the first block
+	s_LastBlock = (Block*)C_KERNEL_HEAP_START;
+	s_LastBlock->m_magic    = Block::FLN_MAGIC;
+	s_LastBlock->m_size     = C_KERNEL_HEAP_INITIAL_SIZE - sizeof(Block);
+	s_LastBlock->m_prevPhys = nullptr;
+	InsertFreeBlock(s_LastBlock);
+}
+
+void KernelHeap::Trim()
+{
+	LockGuard lg(s_KernelHeapLock);
+	TrimHeap(0);
+}
+
+// Aligns a size to 16 bytes, and makes sure the block can hold its links once freed.
+static size_t GetAreaSize(size_t sz)
+{
+	sz = (sz + 15) & ~15;
+	if (sz < C_MIN_AREA)
+		sz = C_MIN_AREA;
+	
+	return sz;
+}
+
+// Takes a free block that can fit a certain size out of the bins. Must be called with the lock held.
+static Block* TakeFreeBlock(size_t sz)
+{
+	Block* pBlock = FindFreeBlock(sz);
+	if (!pBlock)
+	{
+		// we ran out of kernel heap space, so commit some more. The new space ends up in the last block.
+		if (!GrowHeap(sz))
+			return nullptr;
 		
-		if (!pBFN || pBFN->m_size > pNode->m_size)
-			pBFN = pNode;
-		
-		// if the node's size is more than 16 times our original size,
-		// this is a great fit. Otherwise, continue trying for a better fit.
-		if (pBFN->m_size >= 16 * sz)
-			break;
-		
-		pNode = pNode->m_next;
+		pBlock = s_LastBlock;
+	}
+	
+	#ifdef DEBUG_KERNEL_HEAP
+	// make sure that our kernel heap ain't corrupted or anything
+	if (pBlock->m_magic != Block::FLN_MAGIC)
+	{
+		SLogMsg("ERROR: kernel heap corruption detected at %p. Magic: %p. RA: %p", pBlock, pBlock->m_magic, __builtin_return_address(0));
+		return nullptr;
 	}
+	#endif
+	
+	RemoveFreeBlock(pBlock);
+	return pBlock;
+}
+
+void* KernelHeap::Allocate(size_t sz, void* pCallSite)
+{
+	if (!pCallSite)
+		pCallSite = __builtin_return_address(0);
+	
+	if (sz > C_KERNEL_HEAP_MAX_SIZE)
+		return nullptr;
+	
+	sz = GetAreaSize(sz);
+	
+	LockGuard lg(s_KernelHeapLock);
+	
+	Block* pBlock = TakeFreeBlock(sz);
+	if (!pBlock)
+		return nullptr;
 	
-	if (!pBFN)
+	SplitBlock(pBlock, sz);
+	
+	pBlock->m_magic = Block::FLA_MAGIC;
+	ProfileAllocated(pBlock, pCallSite);
+	return pBlock->GetArea();
+}
+
+void* KernelHeap::AllocateAligned(size_t sz, size_t align, void* pCallSite)
+{
+	if (!pCallSite)
+		pCallSite = __builtin_return_address(0);
+	
+	// the areas are always aligned to 16 bytes.
+	if (align <= 16)
+		return Allocate(sz, pCallSite);
+	
+	if (align & (align - 1))
 	{
-		// oops. we ran out of kernel heap space
+		SLogMsg("ERROR: AllocateAligned: alignment %z is not a power of two. RA: %p", align, __builtin_return_address(0));
 		return nullptr;
 	}
 	
-	void *pArea = pBFN->GetArea();
+	if (sz > C_KERNEL_HEAP_MAX_SIZE || align > C_KERNEL_HEAP_MAX_SIZE)
+		return nullptr;
+	
+	sz = GetAreaSize(sz);
 	
-	size_t old_size = pBFN->m_size;
-	pBFN->m_magic = FreeListNode::FLA_MAGIC;
+	LockGuard lg(s_KernelHeapLock);
 	
-	// do we need to create an auxiliary node?
-	if (pBFN->m_size >= sizeof(FreeListNode) + 32)
+	// take a block big enough that the gap before the aligned area can become a free block of its own.
+	Block* pBlock = TakeFreeBlock(sz + align + sizeof(Block) + C_MIN_AREA);
+	if (!pBlock)
+		return nullptr;
+	
+	uintptr_t area = (uintptr_t)pBlock->GetArea();
+	uintptr_t aligned = (area + align - 1) & ~(align - 1);
+	
+	if (aligned != area)
 	{
-		pBFN->m_size  = sz;
-		FreeListNode* pAfter = pBFN->GetPtrDirectlyAfter();
-		pAfter->m_magic = FreeListNode::FLN_MAGIC;
-		pAfter->m_next  = pBFN->m_next;
-		pAfter->m_prev  = pBFN;
-		pAfter->m_size  = old_size - sizeof(FreeListNode) - sz;
-		if (pBFN->m_next) pBFN->m_next->m_prev = pAfter;
-		pBFN->m_next    = pAfter;
+		if (aligned - area < sizeof(Block) + C_MIN_AREA)
+			aligned = (area + sizeof(Block) + C_MIN_AREA + align - 1) & ~(align - 1);
+		
+		pBlock = SplitBlockFront(pBlock, aligned);
 	}
-	else
+	
+	SplitBlock(pBlock, sz);
+	
+	pBlock->m_magic = Block::FLA_MAGIC;
+	ProfileAllocated(pBlock, pCallSite);
+	return pBlock->GetArea();
+}
+
+void* KernelHeap::Reallocate(void* pArea, size_t sz, void* pCallSite)
+{
+	if (!pCallSite)
+		pCallSite = __builtin_return_address(0);
+	
+	if (!pArea)
+		return Allocate(sz, pCallSite);
+	
+	if (sz > C_KERNEL_HEAP_MAX_SIZE)
+		return nullptr;
+	
+	sz = GetAreaSize(sz);
+	
+	size_t oldSize;
+	
 	{
-		// simply mark it as allocated, it's fine.
+		LockGuard lg(s_KernelHeapLock);
+		
+		Block* pBlock = (Block*)pArea - 1;
+		if (pBlock->m_magic != Block::FLA_MAGIC)
+		{
+			SLogMsg("ERROR: attempt to reallocate region %p from kernel heap that wasn't actually allocated (its magic number is %p, RA: %p)", pArea, pBlock->m_magic, __builtin_return_address(0));
+			return nullptr;
+		}
+		
+		oldSize = pBlock->m_size;
+		
+		// shrinking always happens in place.
+		if (sz <= pBlock->m_size)
+		{
+			SplitBlock(pBlock, sz);
+			ProfileResized(pBlock, oldSize);
+			return pArea;
+		}
+		
+		// grow in place by taking over the block after this one, if it's free and big enough.
+		Block* pNext = GetNextBlock(pBlock);
+		if (pNext && pNext->m_magic == Block::FLN_MAGIC && pBlock->m_size + sizeof(Block) + pNext->m_size >= sz)
+		{
+			RemoveFreeBlock(pNext);
+			AbsorbNextBlock(pBlock, pNext);
+			SplitBlock(pBlock, sz);
+			ProfileResized(pBlock, oldSize);
+			return pArea;
+		}
 	}
 	
-	return pArea;
+	// no luck, so move it somewhere else.
+	void* pNewArea = Allocate(sz, pCallSite);
+	if (!pNewArea)
+		return nullptr;
+	
+	memcpy(pNewArea, pArea, oldSize);
+	Free(pArea);
+	
+	return pNewArea;
 }
 
 void KernelHeap::Free(void* pArea)
 {
 	LockGuard lg(s_KernelHeapLock);
 	
-	FreeListNode* pNode = (FreeListNode*)pArea - 1;
-	if (pNode->m_magic != FreeListNode::FLA_MAGIC)
+	Block* pBlock = (Block*)pArea - 1;
+	if (pBlock->m_magic != Block::FLA_MAGIC)
 	{
 		// uh oh! Well, at least we were able to catch this, so just return.
-		SLogMsg("ERROR: attempt to free region %p from kernel heap that wasn't actually allocated (its magic number is %p, a free nodes' is %p, RA: %p)", pArea, pNode->m_magic, FreeListNode::FLN_MAGIC, __builtin_return_address(0));
+		SLogMsg("ERROR: attempt to free region %p from kernel heap that wasn't actually allocated (its magic number is %p, a free blocks' is %p, RA: %p)", pArea, pBlock->m_magic, Block::FLN_MAGIC, __builtin_return_address(0));
+		return;
+	}
+	
+	Block* pNext = GetNextBlock(pBlock);
+	Block* pPrev = pBlock->m_prevPhys;
+	
+	#ifdef DEBUG_KERNEL_HEAP
+	// the boundary tags of the neighbours have to point back at us.
+	if ((pNext && pNext->m_prevPhys != pBlock) || (pPrev && pPrev->GetPtrDirectlyAfter() != pBlock))
+	{
+		SLogMsg("ERROR: kernel heap corruption detected around %p. Previous: %p, next: %p. RA: %p", pBlock, pPrev, pNext, __builtin_return_address(0));
 		return;
 	}
+	#endif
+	
+	ProfileFreed(pBlock);
 	
 	// mark this as free
-	pNode->m_magic = FreeListNode::FLN_MAGIC;
+	pBlock->m_magic = Block::FLN_MAGIC;
+	
+	// merge with the neighbours, if they're free too.
+	if (pNext && pNext->m_magic == Block::FLN_MAGIC)
+	{
+		RemoveFreeBlock(pNext);
+		AbsorbNextBlock(pBlock, pNext);
+	}
 	
-	// you may ask, "iProgram, why are you doing a for loop for 2 iterations here?"
-	// the answer is very simple. The first iteration merges the actual node with its
-	// 'next' neighbour. Afterwards, it changes the pNode variable to the pNode's previous
-	// neighbour. If that node's not free, we simply return, but otherwise, we try to merge
-	// with the next neighbor (which should be the node we are trying to merge with its
-	// neighbors).
-	for (int i = 0; i < 2; i++)
+	if (pPrev && pPrev->m_magic == Block::FLN_MAGIC)
 	{
-		if (pNode->m_magic != FreeListNode::FLN_MAGIC) return;
+		RemoveFreeBlock(pPrev);
+		AbsorbNextBlock(pPrev, pBlock);
+		pBlock = pPrev;
+	}
+	
+	InsertFreeBlock(pBlock);
+	
+	// give the free space at the end back if too much of it piled up.
+	if (pBlock == s_LastBlock && pBlock->m_size >= C_TRIM_THRESHOLD)
+		TrimHeap(C_TRIM_KEEP);
+}
+
+void KernelHeap::DumpProfile()
+{
+#ifdef PROFILE_KERNEL_HEAP
+	LockGuard snapshotLock(s_ProfileSnapshotLock);
+	
+	size_t siteCount = 0, committed = 0;
+	
+	{
+		LockGuard lg(s_KernelHeapLock);
 		
-		// Attempt to connect this with other nodes.
-		if (pNode->m_next && pNode->m_next->m_magic == FreeListNode::FLN_MAGIC)
+		for (size_t i = 0; i < C_PROFILE_SITES; i++)
 		{
-			// merge this and the next together.
-			pNode->m_size = ((uint8_t*)pNode->m_next - (uint8_t*)pNode) + pNode->m_next->m_size;
-			
-			pNode->m_next->m_magic = 0;
-			
-			pNode->m_next = pNode->m_next->m_next;
-			if (pNode->m_next)
-				pNode->m_next->m_prev = pNode;
+			if (s_ProfileSites[i].m_callSite)
+				s_ProfileSnapshot[siteCount++] = s_ProfileSites[i];
 		}
 		
-		pNode = pNode->m_prev;
-		if (!pNode) return;
+		if (s_ProfileOthers.m_allocCount)
+			s_ProfileSnapshot[siteCount++] = s_ProfileOthers;
+		
+		committed = s_HeapEnd - C_KERNEL_HEAP_START;
+	}
+	
+	// sort the call sites by how much they're holding on to, biggest first.
+	for (size_t i = 1; i < siteCount; i++)
+	{
+		ProfileSite site = s_ProfileSnapshot[i];
+		
+		size_t j = i;
+		for (; j > 0 && s_ProfileSnapshot[j - 1].m_liveBytes < site.m_liveBytes; j--)
+			s_ProfileSnapshot[j] = s_ProfileSnapshot[j - 1];
+		
+		s_ProfileSnapshot[j] = site;
+	}
+	
+	SLogMsg("Kernel heap profile: %z bytes committed, %z call sites.", committed, siteCount);
+	
+	for (size_t i = 0; i < siteCount; i++)
+	{
+		ProfileSite& site = s_ProfileSnapshot[i];
+		
+		if (site.m_callSite)
+			SLogMsg("%p: %z bytes live in %z blocks, peak %z bytes, %z allocations", site.m_callSite, site.m_liveBytes, site.m_liveCount, site.m_peakBytes, site.m_allocCount);
+		else
+			SLogMsg("Others:            %z bytes live in %z blocks, peak %z bytes, %z allocations", site.m_liveBytes, site.m_liveCount, site.m_peakBytes, site.m_allocCount);
 	}
+#else
+	SLogMsg("The kernel heap isn't being profiled. Define PROFILE_KERNEL_HEAP in KernelHeap.cpp to do that.");
+#endif
 }
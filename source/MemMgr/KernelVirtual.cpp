@@ -0,0 +1,394 @@
+//  ***************************************************************
+//  KernelVirtual.cpp - Creation date: 17/10/2023
+//  -------------------------------------------------------------
+//  NanoShell64 Copyright (C) 2023 - Licensed under GPL V3
+//
+//  ***************************************************************
+//  Programmer(s):  iProgramInCpp (iprogramincpp@gmail.com)
+//  ***************************************************************
+//  
+//  Module description:
+//      This module implements the kernel virtual address range
+//    allocator. Ranges are handed out from a dedicated PML4 entry
+//    using a bitmap, and backed by whatever pages the PMM has, or
+//    by device memory.
+//      Freed ranges are unmapped right away, but the TLB flush is
+//    deferred, so that many of them can be flushed at once.
+//
+//  ***************************************************************
+#include <Arch.hpp>
+
+namespace VMM
+{
+
+constexpr size_t C_KVA_PAGES = C_KVA_SIZE / PAGE_SIZE;
+
+// The amount of unmapped pages left after each range, to catch overruns.
+constexpr size_t C_GUARD_PAGES = 1;
+
+// The amount of freed ranges, and pages, that may be waiting for a TLB flush.
+constexpr size_t C_MAX_LAZY_RANGES = 64;
+constexpr size_t C_LAZY_PURGE_PAGES = 1024;
+
+constexpr size_t C_NO_RUN = ~0ULL;
+
+constexpr uint64_t C_KVA_FLAGS = PE_PRESENT | PE_READWRITE | PE_SUPERVISOR | PE_EXECUTEDISABLE | PE_PARTOFPMM;
+
+struct LazyRange
+{
+	size_t m_start;
+	size_t m_pageCount;
+};
+
+static Spinlock s_kvaLock;
+
+// A set bit means the page is in use, by a range, its guard page, or a range waiting to be purged.
+static uint64_t s_kvaBitmap[C_KVA_PAGES / 64];
+
+// Where the next search for a free run starts.
+static size_t s_kvaHint;
+
+static LazyRange s_lazyRanges[C_MAX_LAZY_RANGES];
+static size_t s_lazyRangeCount;
+static size_t s_lazyPageCount;
+
+static bool IsPageUsed(size_t index)
+{
+	return s_kvaBitmap[index / 64] & (1ULL << (index % 64));
+}
+
+static void SetPagesUsed(size_t start, size_t count, bool bUsed)
+{
+	for (size_t i = start; i < start + count; i++)
+	{
+		if (bUsed)
+			s_kvaBitmap[i / 64] |=  (1ULL << (i % 64));
+		else
+			s_kvaBitmap[i / 64] &= ~(1ULL << (i % 64));
+	}
+}
+
+// Finds a run of free pages, starting from the hint. Returns C_NO_RUN if there's none.
+static size_t FindFreeRun(size_t count)
+{
+	size_t run = 0, start = 0;
+	size_t index = s_kvaHint;
+	
+	for (size_t scanned = 0; scanned < C_KVA_PAGES; scanned++, index++)
+	{
+		// Runs can't wrap around the end of the region.
+		if (index == C_KVA_PAGES)
+		{
+			index = 0;
+			run = 0;
+		}
+		
+		// Skip over words that are entirely in use.
+		if (run == 0 && index % 64 == 0 && s_kvaBitmap[index / 64] == ~0ULL)
+		{
+			index   += 63;
+			scanned += 63;
+			continue;
+		}
+		
+		if (IsPageUsed(index))
+		{
+			run = 0;
+			continue;
+		}
+		
+		if (run == 0)
+			start = index;
+		
+		if (++run == count)
+			return start;
+	}
+	
+	return C_NO_RUN;
+}
+
+static uintptr_t GetRangeAddress(size_t index)
+{
+	return C_KVA_START + index * PAGE_SIZE;
+}
+
+// Must be called with the lock held. The lock is dropped while the TLBs are flushed, since the other CPUs
+// might be spinning on it with interrupts disabled, and would never answer the shootdown.
+static void PurgeLazyRanges()
+{
+	if (s_lazyRangeCount == 0)
+		return;
+	
+	// Take the ranges out. Their addresses stay reserved in the bitmap until they're purged, and their
+	// entries can't be faulted in anymore, so nobody else touches them in the meantime.
+	LazyRange ranges[C_MAX_LAZY_RANGES];
+	size_t rangeCount = s_lazyRangeCount;
+	
+	for (size_t i = 0; i < rangeCount; i++)
+		ranges[i] = s_lazyRanges[i];
+	
+	s_lazyRangeCount = 0;
+	s_lazyPageCount  = 0;
+	
+	s_kvaLock.Unlock();
+	
+	// Get rid of every CPU's stale entries at once.
+	Arch::TLB::Batch batch;
+	for (size_t i = 0; i < rangeCount; i++)
+		batch.Add(GetRangeAddress(ranges[i].m_start), ranges[i].m_pageCount);
+	
+	batch.Flush();
+	
+	s_kvaLock.Lock();
+	
+	PageMapping* pPM = PageMapping::GetFromCR3();
+	
+	uintptr_t pages[64];
+	size_t pageCount = 0;
+	
+	for (size_t i = 0; i < rangeCount; i++)
+	{
+		LazyRange& range = ranges[i];
+		
+		for (size_t j = 0; j < range.m_pageCount; j++)
+		{
+			PageEntry* pEnt = pPM->GetPageEntry(GetRangeAddress(range.m_start + j));
+			if (!pEnt)
+				continue;
+			
+			// The entry was only marked not present when the range was freed, so it still knows its page.
+			// Demand paged entries that were never faulted in have no page.
+			if (pEnt->m_partOfPmm && pEnt->m_address)
+			{
+				if (pageCount == 64)
+				{
+					PMM::FreePages(pages, pageCount);
+					pageCount = 0;
+				}
+				
+				pages[pageCount++] = pEnt->m_data & C_PAGE_ADDRESS_MASK;
+			}
+			
+			SetEntry(*pEnt, 0);
+		}
+		
+		SetPagesUsed(range.m_start, range.m_pageCount + C_GUARD_PAGES, false);
+	}
+	
+	PMM::FreePages(pages, pageCount);
+}
+
+void InitVirtualRegion()
+{
+	// The kernel half's PML4 entries are copied when cloning a page mapping, so the PML3 has to exist beforehand.
+	if (!PageMapping::GetFromCR3()->GetOrAllocPageDirectory(C_KVA_START))
+		KernelPanic("Could not reserve the kernel virtual address region");
+}
+
+// Reserves the addresses of a range, along with its guard pages. Returns C_NO_RUN if we're out of address space.
+// Must be called with the lock held.
+static size_t ReserveRange(size_t pageCount)
+{
+	size_t start = FindFreeRun(pageCount + C_GUARD_PAGES);
+	if (start == C_NO_RUN && s_lazyRangeCount)
+	{
+		// Some space may be waiting to be purged.
+		PurgeLazyRanges();
+		start = FindFreeRun(pageCount + C_GUARD_PAGES);
+	}
+	
+	if (start == C_NO_RUN)
+		return C_NO_RUN;
+	
+	SetPagesUsed(start, pageCount + C_GUARD_PAGES, true);
+	s_kvaHint = start + pageCount + C_GUARD_PAGES;
+	return start;
+}
+
+// Queues a range whose entries were marked not present to be purged. Must be called with the lock held.
+static void QueueLazyRange(size_t start, size_t pageCount)
+{
+	// Other CPUs may have queued up more ranges while the lock was dropped by the purge.
+	while (s_lazyRangeCount == C_MAX_LAZY_RANGES)
+		PurgeLazyRanges();
+	
+	s_lazyRanges[s_lazyRangeCount++] = { start, pageCount };
+	s_lazyPageCount += pageCount;
+	
+	if (s_lazyPageCount >= C_LAZY_PURGE_PAGES)
+		PurgeLazyRanges();
+}
+
+// Marks an entry not present, so that it can't be faulted in anymore, while keeping its page for the purge to free.
+static void MarkNotPresent(PageEntry* pEnt)
+{
+	// A fault may be installing a page into the entry at the same time, and the purge has to see it.
+	__atomic_fetch_and(&pEnt->m_data, ~(PE_PRESENT | PE_NEEDALLOCPAGE), ATOMIC_MEMORD_ACQ_REL);
+}
+
+// Gives back a range that couldn't be mapped in full. Whatever was mapped is left for the purge, so that the
+// lock is never held across a TLB shootdown.
+static void AbandonRange(size_t start, size_t pageCount)
+{
+	PageMapping* pPM = PageMapping::GetFromCR3();
+	
+	LockGuard lg(s_kvaLock);
+	
+	for (size_t i = 0; i < pageCount; i++)
+	{
+		PageEntry* pEnt = pPM->GetPageEntry(GetRangeAddress(start + i));
+		if (pEnt)
+			MarkNotPresent(pEnt);
+	}
+	
+	QueueLazyRange(start, pageCount);
+}
+
+// Reserves the addresses of a range, along with its guard pages. Returns C_NO_RUN if we're out of address space.
+// The range is mapped with the lock dropped, since mapping it may have to wait for the other CPUs.
+static size_t LockAndReserveRange(size_t pageCount)
+{
+	LockGuard lg(s_kvaLock);
+	return ReserveRange(pageCount);
+}
+
+void* AllocateVirtual(size_t size, bool bDemandPaged)
+{
+	size_t pageCount = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (pageCount == 0)
+		return NULL;
+	
+	size_t start = LockAndReserveRange(pageCount);
+	if (start == C_NO_RUN)
+		return NULL;
+	
+	PageMapping* pPM = PageMapping::GetFromCR3();
+	uintptr_t addr = GetRangeAddress(start);
+	
+	if (bDemandPaged)
+	{
+		if (!pPM->MapDemandPages(addr, pageCount, true, true, true))
+		{
+			AbandonRange(start, pageCount);
+			return NULL;
+		}
+		
+		return (void*)addr;
+	}
+	
+	// Allocate the pages in batches, and map them in.
+	uintptr_t pages[64];
+	for (size_t done = 0; done < pageCount; )
+	{
+		size_t want = pageCount - done;
+		if (want > 64)
+			want = 64;
+		
+		size_t got = PMM::AllocatePages(want, pages), mapped = 0;
+		
+		while (mapped < got && pPM->MapPage(addr + (done + mapped) * PAGE_SIZE, PageEntry(pages[mapped], C_KVA_FLAGS, 0)))
+			mapped++;
+		
+		done += mapped;
+		
+		if (mapped < want)
+		{
+			// We're out of memory, so undo everything.
+			PMM::FreePages(pages + mapped, got - mapped);
+			AbandonRange(start, pageCount);
+			return NULL;
+		}
+	}
+	
+	return (void*)addr;
+}
+
+void FreeVirtual(void* pMem)
+{
+	uintptr_t addr = (uintptr_t)pMem;
+	if (!pMem)
+		return;
+	
+	if (addr < C_KVA_START || addr >= C_KVA_START + C_KVA_SIZE || (addr & (PAGE_SIZE - 1)))
+	{
+		SLogMsg("FreeVirtual: %p was not returned by AllocateVirtual", pMem);
+		return;
+	}
+	
+	LockGuard lg(s_kvaLock);
+	
+	PageMapping* pPM = PageMapping::GetFromCR3();
+	
+	// The range ends where its guard page starts. Only mark the entries not present for now, and leave
+	// the rest to the purge. Demand paged entries are made invalid, so that they aren't faulted in anymore.
+	size_t start = (addr - C_KVA_START) / PAGE_SIZE, pageCount = 0;
+	while (start + pageCount < C_KVA_PAGES)
+	{
+		PageEntry* pEnt = pPM->GetPageEntry(GetRangeAddress(start + pageCount));
+		if (!pEnt || (!pEnt->m_present && !pEnt->m_needAllocPage))
+			break;
+		
+		MarkNotPresent(pEnt);
+		pageCount++;
+	}
+	
+	if (pageCount == 0)
+	{
+		SLogMsg("FreeVirtual: %p was already freed", pMem);
+		return;
+	}
+	
+	QueueLazyRange(start, pageCount);
+}
+
+void PurgeVirtual()
+{
+	LockGuard lg(s_kvaLock);
+	PurgeLazyRanges();
+}
+
+uint64_t GetMemoryTypeFlags(eMemoryType type)
+{
+	switch (type)
+	{
+		case MT_WRITEBACK:    return 0;
+		case MT_WRITETHROUGH: return PE_WRITETHROUGH;
+		case MT_UNCACHED:     return PE_CACHEDISABLE | PE_WRITETHROUGH;
+		case MT_WRITECOMBINE: return PE_PAT;
+	}
+	
+	return PE_CACHEDISABLE | PE_WRITETHROUGH;
+}
+
+void* MapMMIO(uintptr_t phys, size_t size, eMemoryType type)
+{
+	uintptr_t offset = phys & (PAGE_SIZE - 1);
+	size_t pageCount = (offset + size + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (pageCount == 0)
+		return NULL;
+	
+	size_t start = LockAndReserveRange(pageCount);
+	if (start == C_NO_RUN)
+		return NULL;
+	
+	uintptr_t addr = GetRangeAddress(start);
+	
+	// The pages aren't part of the PMM, so purging the range won't try to free them.
+	PageEntry pe(phys - offset, PE_PRESENT | PE_READWRITE | PE_SUPERVISOR | PE_EXECUTEDISABLE | GetMemoryTypeFlags(type), 0);
+	
+	PageMapping* pPM = PageMapping::GetFromCR3();
+	if (!pPM->MapRange(addr, pageCount, pe, true))
+	{
+		AbandonRange(start, pageCount);
+		return NULL;
+	}
+	
+	return (void*)(addr + offset);
+}
+
+void UnmapMMIO(void* pMem)
+{
+	FreeVirtual((void*)(uintptr_t(pMem) & ~(PAGE_SIZE - 1)));
+}
+
+} // namespace VMM
@@ -0,0 +1,161 @@
+//  ***************************************************************
+//  ObjectPool.cpp - Creation date: 17/10/2023
+//  -------------------------------------------------------------
+//  NanoShell64 Copyright (C) 2023 - Licensed under GPL V3
+//
+//  ***************************************************************
+//  Programmer(s):  iProgramInCpp (iprogramincpp@gmail.com)
+//  ***************************************************************
+//  
+//  Module description:
+//      This module implements the untyped part of the object
+//    pools. The free objects are kept in singly linked lists, one
+//    per CPU, and refilled a page at a time from the PMM. A CPU
+//    whose list grows too long hands a batch of it to the pool's
+//    shared list, where the other CPUs can pick it up.
+//
+//  ***************************************************************
+#include <Arch.hpp>
+#include <KObjectPool.hpp>
+
+// The number of slots handed out to pools so far. Like the pools, this is fine being zeroed.
+static Atomic<int> s_nextPoolSlot;
+
+int KObjectPoolBase::GetSlot()
+{
+	int slot = m_slot.Load(ATOMIC_MEMORD_ACQUIRE);
+	if (slot)
+		return slot > 0 ? slot - 1 : -1;
+	
+	int newSlot = s_nextPoolSlot.FetchAdd(1) + 1;
+	if (newSlot > C_MAX_OBJECT_POOLS)
+		newSlot = -1;
+	
+	// If someone else picked one in the meantime, use theirs.
+	if (!m_slot.CompareExchange(&slot, newSlot, false, ATOMIC_MEMORD_ACQ_REL, ATOMIC_MEMORD_ACQUIRE))
+		newSlot = slot;
+	
+	return newSlot > 0 ? newSlot - 1 : -1;
+}
+
+// Gets a list of free objects from a new chunk.
+static void* RefillList(size_t slotSize, size_t slotCount)
+{
+	uintptr_t page = PMM::AllocatePage();
+	if (page == PMM::INVALID_PAGE)
+		return nullptr;
+	
+	uint8_t* pChunk = (uint8_t*)(Arch::GetHHDMOffset() + page);
+	
+	// Link the objects together, in order.
+	for (size_t i = 0; i < slotCount; i++)
+		*(void**)(pChunk + i * slotSize) = (i + 1 < slotCount) ? pChunk + (i + 1) * slotSize : nullptr;
+	
+	return pChunk;
+}
+
+void* KObjectPoolBase::PopObject(KObjectPoolList& list, size_t slotSize, size_t slotCount)
+{
+	if (!list.m_pHead)
+	{
+		list.m_pHead = RefillList(slotSize, slotCount);
+		list.m_count = list.m_pHead ? slotCount : 0;
+	}
+	
+	void* pObj = list.m_pHead;
+	if (pObj)
+	{
+		list.m_pHead = *(void**)pObj;
+		list.m_count--;
+	}
+	
+	return pObj;
+}
+
+void KObjectPoolBase::PushObject(KObjectPoolList& list, void* pObj)
+{
+	*(void**)pObj = list.m_pHead;
+	list.m_pHead = pObj;
+	list.m_count++;
+}
+
+void KObjectPoolBase::MoveObjects(KObjectPoolList& from, KObjectPoolList& to, size_t count)
+{
+	if (!from.m_pHead || count == 0)
+		return;
+	
+	// Find the end of the run being moved, then splice it onto the front of the other list.
+	void* pFirst = from.m_pHead;
+	void* pLast  = pFirst;
+	size_t moved = 1;
+	
+	while (moved < count && *(void**)pLast)
+	{
+		pLast = *(void**)pLast;
+		moved++;
+	}
+	
+	from.m_pHead = *(void**)pLast;
+	from.m_count -= moved;
+	
+	*(void**)pLast = to.m_pHead;
+	to.m_pHead = pFirst;
+	to.m_count += moved;
+}
+
+void* KObjectPoolBase::AllocateObject(size_t slotSize, size_t slotCount)
+{
+	Arch::CPU* pCpu = Arch::CPU::GetCurrent();
+	int slot = GetSlot();
+	
+	if (!pCpu || slot < 0)
+	{
+		LockGuard lg(m_sharedListLock);
+		return PopObject(m_sharedList, slotSize, slotCount);
+	}
+	
+	// Disable interrupts, so that nothing else on this CPU touches the list while we do.
+	bool bState = pCpu->SetInterruptsEnabled(false);
+	
+	KObjectPoolList& list = pCpu->GetObjectPoolList(slot);
+	
+	// Pick up the objects other CPUs spilled before carving up a new page.
+	if (!list.m_pHead && m_sharedList.m_pHead)
+	{
+		LockGuard lg(m_sharedListLock);
+		MoveObjects(m_sharedList, list, C_BATCH_SIZE);
+	}
+	
+	void* pObj = PopObject(list, slotSize, slotCount);
+	
+	pCpu->SetInterruptsEnabled(bState);
+	return pObj;
+}
+
+void KObjectPoolBase::FreeObject(void* pObj)
+{
+	Arch::CPU* pCpu = Arch::CPU::GetCurrent();
+	int slot = GetSlot();
+	
+	if (!pCpu || slot < 0)
+	{
+		LockGuard lg(m_sharedListLock);
+		PushObject(m_sharedList, pObj);
+		return;
+	}
+	
+	bool bState = pCpu->SetInterruptsEnabled(false);
+	
+	KObjectPoolList& list = pCpu->GetObjectPoolList(slot);
+	
+	// Don't let a CPU that frees more than it allocates hoard the objects.
+	if (list.m_count >= C_HIGH_WATERMARK)
+	{
+		LockGuard lg(m_sharedListLock);
+		MoveObjects(list, m_sharedList, C_BATCH_SIZE);
+	}
+	
+	PushObject(list, pObj);
+	
+	pCpu->SetInterruptsEnabled(bState);
+}
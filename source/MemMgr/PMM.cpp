@@ -9,7 +9,7 @@
 //  
 //  Module description:
 //      This module implements a thread safe physical memory
-//  manager.
+//  manager, based on a buddy allocator.
 //
 //  ***************************************************************
 #include <_limine.h>
@@ -24,88 +24,292 @@ volatile limine_memmap_request g_MemMapRequest =
 	.response = NULL,
 };
 
-static PMM::MemoryArea* s_pFirstBMPart, *s_pLastBMPart;
-static Spinlock         s_PMMSpinlock;
-static uint64_t         s_totalAvailablePages; // The total amount of pages available to the system.
+// A NUMA node's share of the physical memory.
+struct PMMNode
+{
+	PMM::MemoryArea* m_pFirstArea, *m_pLastArea;
+	
+	// The lock protecting the areas of this node.
+	Spinlock m_lock;
+	
+	// The total amount of pages this node has.
+	uint64_t m_totalPages;
+	
+	// The amount of free pages this node has, not counting the ones in the per-CPU caches.
+	uint64_t m_freePages;
+	
+	// The nodes to allocate from, starting with this one, in order of distance.
+	int m_fallback[Arch::NUMA::C_MAX_NODES];
+	
+	// The pool of pages zeroed in the background. They're linked together through their first 8 bytes.
+	Spinlock  m_zeroedLock;
+	uintptr_t m_zeroedHead;
+	uint64_t  m_zeroedCount;
+};
+
+static PMMNode  s_nodes[Arch::NUMA::C_MAX_NODES];
+static int      s_nodeCount;
+static uint64_t s_totalAvailablePages; // The total amount of pages available to the system.
+
+static Atomic<uint64_t> s_zeroedHits, s_zeroedMisses, s_pagesZeroed;
+
+// All of the memory areas, sorted by address. Limine guarantees that the memory map is sorted.
+static PMM::MemoryArea* s_areas[PMM::C_MAX_MEMORY_AREAS];
+static int              s_areaCount;
+
+// The section table. For each section of physical memory, this stores the index of the first area that doesn't end before it.
+// This is used to look up the area a page belongs to without walking all of them.
+static uint16_t* s_pSections;
+static uint64_t  s_sectionCount;
 
 // The reason I put these in a "namespace PMM" block is because I don't want to publicize these functions.
 namespace PMM
 {
 
-uintptr_t MemoryArea::RemoveFirst()
+void MemoryArea::PushFree(uint32_t index, int order)
 {
-	PageFreeListNode * pFirst = m_pFirst;
+	PageFrame* pFrame = &m_pFrames[index];
 	
-	// remove it
-	if (pFirst->pNext)
-		pFirst->pNext->pPrev = NULL;
-	m_pFirst = pFirst->pNext;
-	if (m_pLast == pFirst)
-		m_pLast =  NULL;
+	pFrame->m_flags |= PF_FREE;
+	pFrame->m_order  = uint8_t(order);
+	pFrame->m_prev   = C_NO_FRAME;
+	pFrame->m_next   = m_freeLists[order];
 	
-	m_freePages--;
+	if (m_freeLists[order] != C_NO_FRAME)
+		m_pFrames[m_freeLists[order]].m_prev = index;
 	
-	return (uintptr_t)pFirst - Arch::GetHHDMOffset();
+	m_freeLists[order] = index;
 }
 
-void MemoryArea::PushBack(uintptr_t paddr)
+void MemoryArea::RemoveFree(uint32_t index, int order)
 {
-	PageFreeListNode* pLast = m_pLast, *pThis = (PageFreeListNode*)(Arch::GetHHDMOffset() + paddr);
+	PageFrame* pFrame = &m_pFrames[index];
 	
-	pThis->pNext = NULL;
-	pThis->pPrev = pLast;
-	if (pLast)
-		pLast->pNext = pThis;
-	m_pLast = pThis;
-	m_freePages++;
+	if (pFrame->m_prev != C_NO_FRAME)
+		m_pFrames[pFrame->m_prev].m_next = pFrame->m_next;
+	else
+		m_freeLists[order] = pFrame->m_next;
+	
+	if (pFrame->m_next != C_NO_FRAME)
+		m_pFrames[pFrame->m_next].m_prev = pFrame->m_prev;
+	
+	pFrame->m_flags &= ~PF_FREE;
+	pFrame->m_next = pFrame->m_prev = C_NO_FRAME;
 }
 
-// Initialize a MemoryArea free list.
-void InitializeMemoryArea(MemoryArea* pPart)
+int MemoryArea::Carve()
 {
-	uintptr_t ho = Arch::GetHHDMOffset();
-	uintptr_t physAddr = pPart->m_startAddr + ho;
+	if (m_carved >= m_length)
+		return -1;
+	
+	uint64_t pfn = (m_startAddr >> 12) + m_carved;
+	
+	// Take the largest naturally aligned block that fits.
+	int order = C_MAX_ORDER;
+	while (order > 0 && ((pfn & ((1ULL << order) - 1)) != 0 || m_carved + (1ULL << order) > m_length))
+		order--;
+	
+	uint32_t index = uint32_t(m_carved);
+	size_t   count = 1ULL << order;
+	
+	// These descriptors were never touched, so initialize them now.
+	PageFrame* pFrames = &m_pFrames[index];
+	memset(pFrames, 0, count * sizeof(PageFrame));
+	
+	for (size_t i = 0; i < count; i++)
+		pFrames[i].m_area = m_index;
+	
+	m_carved += count;
+	
+	// These pages were already counted as free, so just put the block on its free list.
+	PushFree(index, order);
+	
+	return order;
+}
+
+uintptr_t MemoryArea::AllocateBlock(int order)
+{
+	// Find the smallest free block that fits.
+	int blockOrder = order;
+	while (blockOrder <= C_MAX_ORDER && m_freeLists[blockOrder] == C_NO_FRAME)
+		blockOrder++;
+	
+	// If there is none, carve some never-touched pages off until we get one.
+	while (blockOrder > C_MAX_ORDER)
+	{
+		int carvedOrder = Carve();
+		if (carvedOrder < 0)
+			return INVALID_PAGE;
+		
+		if (carvedOrder >= order)
+			blockOrder = carvedOrder;
+	}
 	
-	PageFreeListNode* first = (PageFreeListNode*)physAddr;
+	uint32_t index = m_freeLists[blockOrder];
+	RemoveFree(index, blockOrder);
 	
-	for (size_t sz = 0; sz != pPart->m_length; sz++, physAddr += PAGE_SIZE)
+	// Split it, giving back the upper halves, until it's the size we want.
+	while (blockOrder > order)
 	{
-		((PageFreeListNode*)physAddr)->pPrev = (PageFreeListNode*)(physAddr - PAGE_SIZE);
-		((PageFreeListNode*)physAddr)->pNext = (PageFreeListNode*)(physAddr + PAGE_SIZE);
+		blockOrder--;
+		PushFree(index + (1U << blockOrder), blockOrder);
 	}
 	
-	PageFreeListNode* last = (PageFreeListNode*)(physAddr - PAGE_SIZE);
-	last ->pNext = NULL;
-	first->pPrev = NULL;
+	m_pFrames[index].m_order = uint8_t(order);
+	m_pFrames[index].m_refCount.Store(1);
+	m_freePages -= 1ULL << order;
 	
-	pPart->m_pFirst = first;
-	pPart->m_pLast  = last;
+	return m_startAddr + index * PAGE_SIZE;
+}
+
+bool MemoryArea::FreeBlock(uintptr_t paddr, int order)
+{
+	uint64_t basePfn = m_startAddr >> 12;
+	uint64_t pfn     = paddr >> 12;
 	
-	// ensure continuity
-	/*
-	PageFreeListNode* pNode = (PageFreeListNode*)(ho + pPart->m_startAddr);
+	if (pfn - basePfn >= m_carved)
+	{
+		SLogMsg("Error, page %p was never allocated", paddr);
+		return false;
+	}
 	
-	while (pNode)
+	if (m_pFrames[pfn - basePfn].m_flags & PF_FREE)
 	{
-		SLogMsg("Node: %p", pNode);
-		pNode = pNode->pNext;
+		SLogMsg("Error, page %p is already free", paddr);
+		return false;
 	}
-	*/
+	
+	m_freePages += 1ULL << order;
+	
+	// The buddies are found using the absolute page frame number, so that blocks stay physically aligned.
+	while (order < C_MAX_ORDER)
+	{
+		uint64_t buddyPfn = pfn ^ (1ULL << order);
+		if (buddyPfn < basePfn || buddyPfn - basePfn + (1ULL << order) > m_length)
+			break;
+		
+		// The descriptors past the carve cursor aren't initialized, and those pages can't be free blocks yet anyway.
+		if (buddyPfn - basePfn >= m_carved)
+			break;
+		
+		uint32_t buddyIndex = uint32_t(buddyPfn - basePfn);
+		PageFrame* pBuddy = &m_pFrames[buddyIndex];
+		
+		// The buddy must be a free block of the same order for us to merge with it.
+		if (!(pBuddy->m_flags & PF_FREE) || pBuddy->m_order != order)
+			break;
+		
+		RemoveFree(buddyIndex, order);
+		
+		pfn &= ~(1ULL << order);
+		order++;
+	}
+	
+	PushFree(uint32_t(pfn - basePfn), order);
+	return true;
+}
+
+// Initialize a MemoryArea. None of its pages or descriptors are touched, they're carved off lazily as needed.
+void InitializeMemoryArea(MemoryArea* pPart)
+{
+	pPart->m_carved    = 0;
+	pPart->m_freePages = pPart->m_length;
 }
 
 // Add a new MemoryArea entry. This may only be called during initialization.
 void AddMemoryArea(MemoryArea* pPart)
 {
-	if (s_pFirstBMPart == NULL)
+	PMMNode& node = s_nodes[pPart->m_node];
+	
+	pPart->m_index = uint16_t(s_areaCount);
+	s_areas[s_areaCount++] = pPart;
+	
+	pPart->m_pLink = NULL;
+	
+	if (node.m_pFirstArea == NULL)
+		node.m_pFirstArea = pPart;
+	else
+		node.m_pLastArea->m_pLink = pPart;
+	
+	node.m_pLastArea = pPart;
+	
+	InitializeMemoryArea(pPart);
+	
+	node.m_totalPages += pPart->m_length;
+	node.m_freePages  += pPart->m_freePages;
+}
+
+// Find the MemoryArea a page resides in.
+MemoryArea* FindMemoryArea(uintptr_t page)
+{
+	uint64_t section = page >> C_SECTION_SHIFT;
+	if (section >= s_sectionCount)
+		return NULL;
+	
+	// Usually, the first area we look at is the right one.
+	for (int i = s_pSections[section]; i < s_areaCount; i++)
 	{
-		s_pFirstBMPart = s_pLastBMPart = pPart;
-		pPart->m_pLink = NULL;
+		MemoryArea* bmp = s_areas[i];
+		
+		if (bmp->m_startAddr > page)
+			break;
+		
+		if (bmp->Contains(page))
+			return bmp;
 	}
 	
-	s_pLastBMPart->m_pLink = pPart;
-	s_pLastBMPart          = pPart;
+	return NULL;
+}
+
+// Build the section table. This may only be called during initialization, after all areas were added.
+void InitializeSectionTable()
+{
+	if (s_areaCount == 0)
+		return;
 	
-	InitializeMemoryArea(pPart);
+	MemoryArea* pLast = s_areas[s_areaCount - 1];
+	uintptr_t end = pLast->m_startAddr + pLast->m_length * PAGE_SIZE;
+	
+	s_sectionCount = (end + (1ULL << C_SECTION_SHIFT) - 1) >> C_SECTION_SHIFT;
+	s_pSections = (uint16_t*)EternalHeap::Allocate(s_sectionCount * sizeof(uint16_t));
+	
+	int areaIndex = 0;
+	for (uint64_t i = 0; i < s_sectionCount; i++)
+	{
+		uintptr_t sectionStart = i << C_SECTION_SHIFT;
+		
+		while (areaIndex < s_areaCount && s_areas[areaIndex]->m_startAddr + s_areas[areaIndex]->m_length * PAGE_SIZE <= sectionStart)
+			areaIndex++;
+		
+		s_pSections[i] = uint16_t(areaIndex);
+	}
+}
+
+// Sort the fallback list of each node by distance. This may only be called during initialization.
+void InitializeFallbackLists()
+{
+	for (int i = 0; i < s_nodeCount; i++)
+	{
+		int* pFallback = s_nodes[i].m_fallback;
+		
+		for (int j = 0; j < s_nodeCount; j++)
+			pFallback[j] = j;
+		
+		// Insertion sort. There are only a few nodes, and we want nodes that are equally far away to stay in order.
+		for (int j = 1; j < s_nodeCount; j++)
+		{
+			int item = pFallback[j], dist = Arch::NUMA::GetDistance(i, item);
+			int k = j - 1;
+			
+			while (k >= 0 && Arch::NUMA::GetDistance(i, pFallback[k]) > dist)
+			{
+				pFallback[k + 1] = pFallback[k];
+				k--;
+			}
+			
+			pFallback[k + 1] = item;
+		}
+	}
 }
 
 };
@@ -115,6 +319,22 @@ uint64_t PMM::GetTotalPages()
 	return s_totalAvailablePages;
 }
 
+uint64_t PMM::GetTotalPages(int node)
+{
+	if (node < 0 || node >= s_nodeCount)
+		return 0;
+	
+	return s_nodes[node].m_totalPages;
+}
+
+uint64_t PMM::GetFreePages(int node)
+{
+	if (node < 0 || node >= s_nodeCount)
+		return 0;
+	
+	return s_nodes[node].m_freePages;
+}
+
 void PMM::Init()
 {
 	// Check if we have the memmap response.
@@ -125,6 +345,11 @@ void PMM::Init()
 		Arch::IdleLoop();
 	}
 	
+	// Find out which memory belongs to which NUMA node.
+	Arch::NUMA::Init();
+	
+	s_nodeCount = Arch::NUMA::GetNodeCount();
+	
 	// For each memory map entry.
 	auto resp = g_MemMapRequest.response;
 	for (uint64_t i = 0; i != resp->entry_count; i++)
@@ -138,64 +363,808 @@ void PMM::Init()
 			continue;
 		}
 		
-		// Check how many pages we have.
-		size_t nPages = (entry->length + PAGE_SIZE - 1) / PAGE_SIZE;
+		// Split the entry up at NUMA node boundaries.
+		uintptr_t base = entry->base, end = entry->base + entry->length;
+		while (base < end)
+		{
+			uint64_t length = end - base;
+			int node = Arch::NUMA::GetNodeOfRange(base, length);
+			
+			uintptr_t areaBase = base;
+			base += length;
+			
+			// Check how many pages we have.
+			size_t nPages = length / PAGE_SIZE;
+			
+			// The frame descriptors are placed at the start of the area itself.
+			size_t nFramePages = (nPages * sizeof(PageFrame) + PAGE_SIZE - 1) / PAGE_SIZE;
+			if (nPages <= nFramePages)
+				continue;
+			
+			PageFrame* pFrames = (PageFrame*)(Arch::GetHHDMOffset() + areaBase);
+			
+			if (s_areaCount >= C_MAX_MEMORY_AREAS)
+			{
+				SLogMsg("PMM: Too many memory areas, ignoring %p-%p", areaBase, base);
+				continue;
+			}
+			
+			// TODO: Assert that entry->base is page aligned
+			void* pMem = EternalHeap::Allocate(sizeof(MemoryArea));
+			memset(pMem, 0, sizeof(MemoryArea));
+			
+			MemoryArea* pPart = new(pMem) MemoryArea(areaBase + nFramePages * PAGE_SIZE, nPages - nFramePages, pFrames, node);
+			
+			s_totalAvailablePages += pPart->m_length;
+			
+			AddMemoryArea(pPart);
+		}
+	}
+	
+	InitializeFallbackLists();
+	InitializeSectionTable();
+	
+	for (int i = 0; i < s_nodeCount; i++)
+		SLogMsg("PMM: Node %d has %llu pages", i, s_nodes[i].m_totalPages);
+}
+
+// Note: The node's lock must be held.
+static uintptr_t AllocatePagesUnlocked(PMMNode& node, int order)
+{
+	using namespace PMM;
+	
+	// if there aren't enough free pages, don't bother
+	if (node.m_freePages < (1ULL << order))
+		return INVALID_PAGE;
+	
+	// browse through the whole MemoryArea chain
+	for (MemoryArea* bmp = node.m_pFirstArea; bmp; bmp = bmp->m_pLink)
+	{
+		if (bmp->m_freePages < (1ULL << order))
+			continue;
 		
-		// TODO: Assert that entry->base is page aligned
-		void* pMem = EternalHeap::Allocate(sizeof(MemoryArea));
-		memset(pMem, 0, sizeof(MemoryArea));
+		uintptr_t page = bmp->AllocateBlock(order);
+		if (page != INVALID_PAGE)
+		{
+			node.m_freePages -= 1ULL << order;
+			return page;
+		}
+	}
+	
+	return INVALID_PAGE;
+}
+
+// Note: The lock of the area's node must be held.
+static void FreePagesUnlocked(PMM::MemoryArea* bmp, uintptr_t page, int order)
+{
+	if (bmp->FreeBlock(page, order))
+		s_nodes[bmp->m_node].m_freePages += 1ULL << order;
+}
+
+// Finds the area a block resides in, and checks that the entire block is inside of it.
+static PMM::MemoryArea* FindMemoryAreaOfBlock(uintptr_t page, int order)
+{
+	PMM::MemoryArea* bmp = PMM::FindMemoryArea(page);
+	if (!bmp || !bmp->Contains(page + (PAGE_SIZE << order) - 1))
+	{
+		SLogMsg("Error, trying to free page %p, not within any of our memory areas", page);
+		return NULL;
+	}
+	
+	return bmp;
+}
+
+// Get the NUMA node to allocate memory from by default.
+static int GetPreferredNode()
+{
+	Arch::CPU* pCpu = Arch::CPU::GetCurrent();
+	if (!pCpu)
+		return 0;
+	
+	return pCpu->GetNumaNode();
+}
+
+// Disables interrupts on the current CPU, if there is one. The node locks may only be held with interrupts disabled,
+// otherwise a page fault handled while holding one could deadlock.
+static bool DisableInterrupts()
+{
+	Arch::CPU* pCpu = Arch::CPU::GetCurrent();
+	if (!pCpu)
+		return false;
+	
+	return pCpu->SetInterruptsEnabled(false);
+}
+
+static void RestoreInterrupts(bool bState)
+{
+	Arch::CPU* pCpu = Arch::CPU::GetCurrent();
+	if (!pCpu)
+		return;
+	
+	pCpu->SetInterruptsEnabled(bState);
+}
+
+// Gives the pages in every CPU's page cache back to the global free lists, so that they can be handed out
+// elsewhere, or merged back into bigger blocks. This is done when the global free lists run dry.
+// A cache is only ever touched by its own CPU, so the others are asked to drain theirs through an IPI.
+static void DrainAllPageCaches()
+{
+	Arch::CPU* pSelf = Arch::CPU::GetCurrent();
+	if (!pSelf)
+		return;
+	
+	bool bState = DisableInterrupts();
+	
+	uint64_t cpuCount = Arch::CPU::GetCount();
+	
+	for (uint64_t i = 0; i < cpuCount; i++)
+	{
+		Arch::CPU* pCpu = Arch::CPU::GetCPU(i);
+		if (!pCpu || pCpu == pSelf)
+			continue;
 		
-		MemoryArea* pPart = new(pMem) MemoryArea(entry->base, nPages);
+		PMM::PageCache* pCache = pCpu->GetPageCache();
+		if (!pCache->m_bOnline.Load())
+			continue;
+		
+		pCache->m_requestedGen.FetchAdd(1);
+		pCpu->SendDrainIPI();
+	}
+	
+	pSelf->GetPageCache()->DrainAll();
+	
+	for (uint64_t i = 0; i < cpuCount; i++)
+	{
+		Arch::CPU* pCpu = Arch::CPU::GetCPU(i);
+		if (!pCpu || pCpu == pSelf)
+			continue;
 		
-		s_totalAvailablePages += pPart->m_length;
+		PMM::PageCache* pCache = pCpu->GetPageCache();
+		if (!pCache->m_bOnline.Load())
+			continue;
 		
-		AddMemoryArea(pPart);
+		// While we wait, carry out the drains others have requested from us, since
+		// they might be waiting on us in the same way, with their interrupts disabled.
+		while (pCache->m_completedGen.Load() < pCache->m_requestedGen.Load())
+		{
+			PMM::ProcessDrainRequest();
+			Spinlock::SpinHint();
+		}
 	}
+	
+	RestoreInterrupts(bState);
 }
 
-uintptr_t PMM::AllocatePage()
+static uintptr_t AllocatePagesFromNodeOnce(int preferredNode, int order)
 {
-	LockGuard lg (s_PMMSpinlock);
+	PMMNode& preferred = s_nodes[preferredNode];
+	
+	uintptr_t page = PMM::INVALID_PAGE;
+	bool bState = DisableInterrupts();
+	
+	for (int i = 0; i < s_nodeCount && page == PMM::INVALID_PAGE; i++)
+	{
+		PMMNode& node = s_nodes[preferred.m_fallback[i]];
+		
+		LockGuard lg (node.m_lock);
+		page = AllocatePagesUnlocked(node, order);
+	}
+	
+	RestoreInterrupts(bState);
+	return page;
+}
+
+// Allocates a block, trying the nodes in order of their distance from the preferred one.
+// If they're all out of memory, the page caches are drained, and we try again.
+// Note: This must not be called in the middle of an operation on the current CPU's page cache.
+static uintptr_t AllocatePagesFromNode(int preferredNode, int order)
+{
+	uintptr_t page = AllocatePagesFromNodeOnce(preferredNode, order);
+	if (page != PMM::INVALID_PAGE)
+		return page;
+	
+	DrainAllPageCaches();
+	return AllocatePagesFromNodeOnce(preferredNode, order);
+}
+
+static void FreePagesToNode(uintptr_t page, int order)
+{
+	PMM::MemoryArea* bmp = FindMemoryAreaOfBlock(page, order);
+	if (!bmp)
+		return;
+	
+	bool bState = DisableInterrupts();
 	
-	// browse through the whole MemoryArea chain
-	MemoryArea* bmp = s_pFirstBMPart;
-	while (bmp)
 	{
-		// if there are no free list nodes
-		if (bmp->m_pFirst == NULL || bmp->m_pLast == NULL || bmp->m_freePages == 0)
+		LockGuard lg (s_nodes[bmp->m_node].m_lock);
+		FreePagesUnlocked(bmp, page, order);
+	}
+	
+	RestoreInterrupts(bState);
+}
+
+// Takes a page from a node's zeroed page pool.
+static uintptr_t TakeZeroedPage(PMMNode& node)
+{
+	// Don't bother with the lock if the pool is empty.
+	if (node.m_zeroedCount == 0)
+		return PMM::INVALID_PAGE;
+	
+	bool bState = DisableInterrupts();
+	
+	uintptr_t page = PMM::INVALID_PAGE;
+	
+	{
+		LockGuard lg (node.m_zeroedLock);
+		
+		if (node.m_zeroedHead != PMM::INVALID_PAGE)
 		{
-			bmp = bmp->m_pLink;
+			page = node.m_zeroedHead;
+			
+			PMM::PageFrame* pFrame = PMM::GetPageFrame(page);
+			pFrame->m_flags &= ~PMM::PF_ZEROED;
+			pFrame->m_refCount.Store(1);
+			
+			uintptr_t* pLink = (uintptr_t*)(Arch::GetHHDMOffset() + page);
+			node.m_zeroedHead = *pLink;
+			node.m_zeroedCount--;
+			
+			// The link was the only part of the page that wasn't zero.
+			*pLink = 0;
+		}
+	}
+	
+	RestoreInterrupts(bState);
+	return page;
+}
+
+// Takes a zeroed page from any node, trying the nodes in order of their distance from the preferred one.
+static uintptr_t TakeZeroedPageFromNode(int preferredNode)
+{
+	PMMNode& preferred = s_nodes[preferredNode];
+	
+	for (int i = 0; i < s_nodeCount; i++)
+	{
+		uintptr_t page = TakeZeroedPage(s_nodes[preferred.m_fallback[i]]);
+		if (page != PMM::INVALID_PAGE)
+			return page;
+	}
+	
+	return PMM::INVALID_PAGE;
+}
+
+static void PutZeroedPage(PMMNode& node, uintptr_t page)
+{
+	PMM::PageFrame* pFrame = PMM::GetPageFrame(page);
+	if (!pFrame)
+		return;
+	
+	pFrame->m_refCount.Store(0);
+	pFrame->m_flags |= PMM::PF_ZEROED;
+	
+	bool bState = DisableInterrupts();
+	
+	{
+		LockGuard lg (node.m_zeroedLock);
+		
+		*((uintptr_t*)(Arch::GetHHDMOffset() + page)) = node.m_zeroedHead;
+		node.m_zeroedHead = page;
+		node.m_zeroedCount++;
+	}
+	
+	RestoreInterrupts(bState);
+}
+
+// Allocates up to `count` single pages, taking each node's lock only once. Returns the amount of pages allocated.
+// Note: Interrupts must be disabled.
+static size_t AllocatePageArrayFromNodes(int preferredNode, uintptr_t* pPages, size_t count)
+{
+	PMMNode& preferred = s_nodes[preferredNode];
+	
+	size_t allocated = 0;
+	
+	for (int i = 0; i < s_nodeCount && allocated < count; i++)
+	{
+		PMMNode& node = s_nodes[preferred.m_fallback[i]];
+		
+		LockGuard lg (node.m_lock);
+		
+		while (allocated < count)
+		{
+			uintptr_t page = AllocatePagesUnlocked(node, 0);
+			if (page == PMM::INVALID_PAGE)
+				break;
+			
+			pPages[allocated++] = page;
+		}
+	}
+	
+	return allocated;
+}
+
+// Frees an array of single pages with no references left. The pages may belong to different nodes, so only switch locks when the node changes.
+// Note: Interrupts must be disabled.
+static void FreePageArrayToNodes(const uintptr_t* pPages, size_t count)
+{
+	Spinlock* pLock = NULL;
+	
+	for (size_t i = 0; i < count; i++)
+	{
+		PMM::MemoryArea* bmp = FindMemoryAreaOfBlock(pPages[i], 0);
+		if (!bmp)
 			continue;
+		
+		Spinlock* pNodeLock = &s_nodes[bmp->m_node].m_lock;
+		if (pLock != pNodeLock)
+		{
+			if (pLock)
+				pLock->Unlock();
+			
+			pLock = pNodeLock;
+			pLock->Lock();
 		}
 		
-		// there is one. Remove it and return.
-		return bmp->RemoveFirst();
+		FreePagesUnlocked(bmp, pPages[i], 0);
 	}
 	
-	return INVALID_PAGE;
+	if (pLock)
+		pLock->Unlock();
+}
+
+void PMM::PageCache::Refill(int preferredNode)
+{
+	if (m_count >= C_BATCH_SIZE)
+		return;
+	
+	size_t allocated = AllocatePageArrayFromNodes(preferredNode, &m_pages[m_count], C_BATCH_SIZE - m_count);
+	
+	for (size_t i = 0; i < allocated; i++)
+	{
+		PageFrame* pFrame = GetPageFrame(m_pages[m_count + i]);
+		pFrame->m_flags |= PF_CACHED;
+		pFrame->m_refCount.Store(0);
+	}
+	
+	m_count += allocated;
+}
+
+void PMM::PageCache::Drain()
+{
+	// The coldest pages are at the bottom of the stack.
+	size_t count = C_BATCH_SIZE;
+	if (count > m_count)
+		count = m_count;
+	
+	for (size_t i = 0; i < count; i++)
+	{
+		PageFrame* pFrame = GetPageFrame(m_pages[i]);
+		if (pFrame)
+			pFrame->m_flags &= ~PF_CACHED;
+	}
+	
+	FreePageArrayToNodes(m_pages, count);
+	
+	// Move the remaining, hotter pages down.
+	m_count -= count;
+	for (size_t i = 0; i < m_count; i++)
+		m_pages[i] = m_pages[i + count];
+}
+
+void PMM::PageCache::DrainAll()
+{
+	for (size_t i = 0; i < m_count; i++)
+	{
+		PageFrame* pFrame = GetPageFrame(m_pages[i]);
+		if (pFrame)
+			pFrame->m_flags &= ~PF_CACHED;
+	}
+	
+	FreePageArrayToNodes(m_pages, m_count);
+	m_count = 0;
+}
+
+void PMM::OnCPUOnline()
+{
+	Arch::CPU::GetCurrent()->GetPageCache()->m_bOnline.Store(true);
+}
+
+void PMM::ProcessDrainRequest()
+{
+	PageCache* pCache = Arch::CPU::GetCurrent()->GetPageCache();
+	
+	// Any request made up to this point is satisfied by the drain below.
+	uint64_t gen = pCache->m_requestedGen.Load();
+	if (pCache->m_completedGen.Load() >= gen)
+		return;
+	
+	pCache->DrainAll();
+	
+	pCache->m_completedGen.Store(gen);
+}
+
+uintptr_t PMM::AllocatePage()
+{
+	Arch::CPU* pCpu = Arch::CPU::GetCurrent();
+	
+	// If this CPU isn't set up yet, go straight to the global free lists.
+	if (!pCpu)
+		return AllocatePagesFromNode(0, 0);
+	
+	// Disable interrupts, so that nothing else on this CPU touches the cache while we do.
+	bool bState = pCpu->SetInterruptsEnabled(false);
+	
+	PageCache* pCache = pCpu->GetPageCache();
+	uintptr_t page = INVALID_PAGE;
+	
+	if (pCache->m_count == 0)
+		pCache->Refill(pCpu->GetNumaNode());
+	
+	if (pCache->m_count != 0)
+	{
+		page = pCache->m_pages[--pCache->m_count];
+		
+		PageFrame* pFrame = GetPageFrame(page);
+		pFrame->m_flags &= ~PF_CACHED;
+		pFrame->m_refCount.Store(1);
+	}
+	
+	pCpu->SetInterruptsEnabled(bState);
+	
+	// The global free lists are empty too, but other CPUs may still have some pages cached.
+	if (page == INVALID_PAGE)
+		page = AllocatePagesFromNode(pCpu->GetNumaNode(), 0);
+	
+	// If we're out of free pages, the zeroed page pools are the last resort.
+	if (page == INVALID_PAGE)
+		page = TakeZeroedPageFromNode(pCpu->GetNumaNode());
+	
+	return page;
+}
+
+// Drops a reference to an allocated block. Returns true if that was the last one, and the block should be freed.
+static bool DropReference(uintptr_t page)
+{
+	PMM::PageFrame* pFrame = PMM::GetPageFrame(page);
+	if (!pFrame)
+	{
+		SLogMsg("Error, trying to free page %p, not within any of our memory areas", page);
+		return false;
+	}
+	
+	if (pFrame->m_flags & (PMM::PF_FREE | PMM::PF_CACHED | PMM::PF_ZEROED) || pFrame->m_refCount.Load() == 0)
+	{
+		SLogMsg("Error, page %p is already free", page);
+		return false;
+	}
+	
+	return pFrame->m_refCount.SubFetch(1) == 0;
 }
 
 void PMM::FreePage(uintptr_t page)
 {
-	LockGuard lg (s_PMMSpinlock);
+	if (!DropReference(page))
+		return;
+	
+	Arch::CPU* pCpu = Arch::CPU::GetCurrent();
+	
+	// If this CPU isn't set up yet, go straight to the global free lists.
+	if (!pCpu)
+	{
+		FreePagesToNode(page, 0);
+		return;
+	}
+	
+	bool bState = pCpu->SetInterruptsEnabled(false);
+	
+	PageCache* pCache = pCpu->GetPageCache();
+	
+	if (pCache->m_count >= PageCache::C_HIGH_WATERMARK)
+		pCache->Drain();
+	
+	GetPageFrame(page)->m_flags |= PF_CACHED;
+	pCache->m_pages[pCache->m_count++] = page;
+	
+	pCpu->SetInterruptsEnabled(bState);
+}
+
+void PMM::ReferencePage(uintptr_t page)
+{
+	PageFrame* pFrame = GetPageFrame(page);
+	if (!pFrame)
+	{
+		SLogMsg("Error, trying to reference page %p, not within any of our memory areas", page);
+		return;
+	}
+	
+	pFrame->m_refCount.FetchAdd(1);
+}
+
+PMM::PageFrame* PMM::GetPageFrame(uintptr_t page)
+{
+	MemoryArea* bmp = FindMemoryArea(page);
+	if (!bmp || !bmp->IsCarved(page))
+		return NULL;
+	
+	return bmp->GetPageFrame(page);
+}
+
+PMM::MemoryArea* PMM::GetMemoryArea(const PageFrame* pFrame)
+{
+	return s_areas[pFrame->m_area];
+}
+
+void PMM::DumpPageFrame(uintptr_t page)
+{
+	MemoryArea* pArea = FindMemoryArea(page);
+	if (!pArea)
+	{
+		LogMsg("Page %p: not managed by the PMM", page);
+		return;
+	}
+	
+	if (!pArea->IsCarved(page))
+	{
+		LogMsg("Page %p: area %d (node %d)  never used", page, pArea->m_index, pArea->m_node);
+		return;
+	}
+	
+	PageFrame* pFrame = pArea->GetPageFrame(page);
+	
+	MemoryArea* bmp = GetMemoryArea(pFrame);
+	
+	LogMsg("Page %p: area %d (node %d)  refcount %u  order %d  flags %s%s%s%s",
+		page,
+		pFrame->m_area,
+		bmp->m_node,
+		pFrame->m_refCount.Load(),
+		pFrame->m_order,
+		pFrame->m_flags & PF_FREE   ? "F" : "-",
+		pFrame->m_flags & PF_CACHED ? "C" : "-",
+		pFrame->m_flags & PF_ZEROED ? "Z" : "-",
+		pFrame->m_flags & PF_SLAB   ? "S" : "-");
+}
+
+size_t PMM::AllocatePages(size_t count, uintptr_t* pPages)
+{
+	Arch::CPU* pCpu = Arch::CPU::GetCurrent();
+	int node = GetPreferredNode();
+	
+	size_t allocated = 0;
+	bool bState = DisableInterrupts();
 	
-	// Find the bitmap part where this page resides;
-	MemoryArea* bmp = s_pFirstBMPart;
-	while (bmp)
+	// Take what we can from this CPU's cache first.
+	if (pCpu)
 	{
-		if (bmp->m_startAddr <= page) break;
+		PageCache* pCache = pCpu->GetPageCache();
 		
-		bmp = bmp->m_pLink;
+		while (allocated < count && pCache->m_count != 0)
+		{
+			uintptr_t page = pCache->m_pages[--pCache->m_count];
+			
+			PageFrame* pFrame = GetPageFrame(page);
+			pFrame->m_flags &= ~PF_CACHED;
+			pFrame->m_refCount.Store(1);
+			
+			pPages[allocated++] = page;
+		}
 	}
 	
-	if (!bmp)
+	// Then grab the rest straight from the nodes.
+	if (allocated < count)
+		allocated += AllocatePageArrayFromNodes(node, &pPages[allocated], count - allocated);
+	
+	// If they ran dry, other CPUs may still have some pages cached.
+	if (allocated < count)
+	{
+		DrainAllPageCaches();
+		allocated += AllocatePageArrayFromNodes(node, &pPages[allocated], count - allocated);
+	}
+	
+	RestoreInterrupts(bState);
+	
+	// If we're out of free pages, the zeroed page pools are the last resort.
+	while (allocated < count)
+	{
+		uintptr_t page = TakeZeroedPageFromNode(node);
+		if (page == INVALID_PAGE)
+			break;
+		
+		pPages[allocated++] = page;
+	}
+	
+	return allocated;
+}
+
+void PMM::FreePages(const uintptr_t* pPages, size_t count)
+{
+	Arch::CPU* pCpu = Arch::CPU::GetCurrent();
+	
+	// The pages that didn't fit in the cache are freed in chunks.
+	uintptr_t toFree[PageCache::C_BATCH_SIZE];
+	size_t toFreeCount = 0;
+	
+	bool bState = DisableInterrupts();
+	
+	PageCache* pCache = pCpu ? pCpu->GetPageCache() : NULL;
+	
+	for (size_t i = 0; i < count; i++)
+	{
+		uintptr_t page = pPages[i];
+		if (!DropReference(page))
+			continue;
+		
+		// If there's room in the cache, put it there, it's likely to be reused soon.
+		if (pCache && pCache->m_count < PageCache::C_HIGH_WATERMARK)
+		{
+			GetPageFrame(page)->m_flags |= PF_CACHED;
+			pCache->m_pages[pCache->m_count++] = page;
+			continue;
+		}
+		
+		toFree[toFreeCount++] = page;
+		
+		if (toFreeCount == PageCache::C_BATCH_SIZE)
+		{
+			FreePageArrayToNodes(toFree, toFreeCount);
+			toFreeCount = 0;
+		}
+	}
+	
+	FreePageArrayToNodes(toFree, toFreeCount);
+	
+	RestoreInterrupts(bState);
+}
+
+PMM::PageBatch::~PageBatch()
+{
+	// Give back whatever wasn't used.
+	FreePages(&m_pages[m_index], m_count - m_index);
+}
+
+uintptr_t PMM::PageBatch::Get()
+{
+	if (m_index == m_count)
+	{
+		m_count = AllocatePages(C_SIZE, m_pages);
+		m_index = 0;
+		
+		if (m_count == 0)
+			return INVALID_PAGE;
+	}
+	
+	return m_pages[m_index++];
+}
+
+uintptr_t PMM::AllocatePages(int order)
+{
+	if (order < 0 || order > C_MAX_ORDER)
+		return INVALID_PAGE;
+	
+	// Single pages go through the page cache.
+	if (order == 0)
+		return AllocatePage();
+	
+	return AllocatePagesFromNode(GetPreferredNode(), order);
+}
+
+uintptr_t PMM::AllocatePagesOnNode(int node, int order)
+{
+	if (order < 0 || order > C_MAX_ORDER || node < 0 || node >= s_nodeCount)
+		return INVALID_PAGE;
+	
+	return AllocatePagesFromNode(node, order);
+}
+
+void PMM::SplitBlock(uintptr_t addr, int order)
+{
+	MemoryArea* bmp = FindMemoryArea(addr);
+	if (!bmp || !bmp->Contains(addr + (PAGE_SIZE << order) - 1) || !bmp->IsCarved(addr))
 	{
-		SLogMsg("Error, trying to free page %p, not within any of our bitmap parts", page);
+		SLogMsg("Error, trying to split block %p, not within any of our memory areas", addr);
 		return;
 	}
 	
-	// Append it to the last freelist index.
-	bmp->PushBack(page);
+	PageFrame* pFrames = bmp->GetPageFrame(addr);
+	if (pFrames->m_order != order)
+	{
+		SLogMsg("Error, trying to split block %p of order %d, but it's of order %d", addr, order, pFrames->m_order);
+		return;
+	}
+	
+	uint32_t refCount = pFrames->m_refCount.Load();
+	
+	for (size_t i = 0; i < (1ULL << order); i++)
+	{
+		pFrames[i].m_order = 0;
+		pFrames[i].m_refCount.Store(refCount);
+	}
+}
+
+void PMM::FreePages(uintptr_t addr, int order)
+{
+	if (order < 0 || order > C_MAX_ORDER || (addr & ((PAGE_SIZE << order) - 1)))
+	{
+		SLogMsg("Error, trying to free block %p of order %d, which is invalid", addr, order);
+		return;
+	}
+	
+	// Freeing with the wrong order would hand pages that are still in use (or a partial block) back to the buddy
+	// allocator. Free blocks are left to DropReference to complain about.
+	PageFrame* pFrame = GetPageFrame(addr);
+	if (pFrame && !(pFrame->m_flags & (PF_FREE | PF_CACHED | PF_ZEROED)) && pFrame->m_order != order)
+	{
+		SLogMsg("Error, trying to free block %p of order %d, but it's of order %d", addr, order, pFrame->m_order);
+		return;
+	}
+	
+	if (order == 0)
+	{
+		FreePage(addr);
+		return;
+	}
+	
+	if (!DropReference(addr))
+		return;
+	
+	FreePagesToNode(addr, order);
+}
+
+uintptr_t PMM::AllocateZeroedPage()
+{
+	uintptr_t page = TakeZeroedPageFromNode(GetPreferredNode());
+	if (page != INVALID_PAGE)
+	{
+		s_zeroedHits.FetchAdd(1);
+		return page;
+	}
+	
+	s_zeroedMisses.FetchAdd(1);
+	
+	page = AllocatePage();
+	if (page != INVALID_PAGE)
+		memset((void*)(Arch::GetHHDMOffset() + page), 0, PAGE_SIZE);
+	
+	return page;
+}
+
+bool PMM::ZeroFreePages(size_t count)
+{
+	int nodeIndex = GetPreferredNode();
+	PMMNode& node = s_nodes[nodeIndex];
+	
+	for (size_t i = 0; i < count; i++)
+	{
+		// Stop once the pool is full, or if the node is running low on free memory.
+		if (node.m_zeroedCount >= C_ZEROED_POOL_SIZE || node.m_freePages < C_ZEROED_POOL_SIZE)
+			return false;
+		
+		// Take it straight from the node, so that we don't eat up this CPU's cache-hot pages.
+		uintptr_t page = AllocatePagesFromNode(nodeIndex, 0);
+		if (page == INVALID_PAGE)
+			return false;
+		
+		memset((void*)(Arch::GetHHDMOffset() + page), 0, PAGE_SIZE);
+		
+		PutZeroedPage(node, page);
+		s_pagesZeroed.FetchAdd(1);
+	}
+	
+	return true;
+}
+
+PMM::ZeroedPoolStats PMM::GetZeroedPoolStats()
+{
+	ZeroedPoolStats stats;
+	
+	stats.m_hits        = s_zeroedHits.Load();
+	stats.m_misses      = s_zeroedMisses.Load();
+	stats.m_pagesZeroed = s_pagesZeroed.Load();
+	stats.m_poolSize    = 0;
+	
+	for (int i = 0; i < s_nodeCount; i++)
+		stats.m_poolSize += s_nodes[i].m_zeroedCount;
+	
+	return stats;
 }
 
 void PMM::Test()
@@ -208,4 +1177,13 @@ void PMM::Test()
 	addr = PMM::AllocatePage();
 	LogMsg("Addr: %p", addr);
 	PMM::FreePage(addr);
+	
+	// These two should also be the same, and aligned to 16 KB.
+	addr = PMM::AllocatePages(2);
+	LogMsg("Addr: %p", addr);
+	PMM::FreePages(addr, 2);
+	
+	addr = PMM::AllocatePages(2);
+	LogMsg("Addr: %p", addr);
+	PMM::FreePages(addr, 2);
 }
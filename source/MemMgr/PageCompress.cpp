@@ -0,0 +1,187 @@
+//  ***************************************************************
+//  PageCompress.cpp - Creation date: 17/10/2023
+//  -------------------------------------------------------------
+//  NanoShell64 Copyright (C) 2023 - Licensed under GPL V3
+//
+//  ***************************************************************
+//  Programmer(s):  iProgramInCpp (iprogramincpp@gmail.com)
+//  ***************************************************************
+//  
+//  Module description:
+//      This module implements the poor man's compression. Pages
+//    filled to the brim with a single byte are turned back into
+//    demand paged entries that remember the byte, and the page is
+//    freed. The page fault handler brings them back on access.
+//
+//  ***************************************************************
+#include <Arch.hpp>
+
+namespace VMM
+{
+
+static Atomic<uint64_t> s_pagesCompressed;
+static Atomic<uint64_t> s_pagesStillCompressed;
+
+// Checks if an entry holds a compressed page.
+static bool IsCompressedPage(const PageEntry& ent)
+{
+	return !ent.m_present && ent.m_needAllocPage && (ent.m_address & C_COMPRESSED_PAGE_MARK);
+}
+
+void ForgetCompressedPage(const PageEntry& ent)
+{
+	if (IsCompressedPage(ent))
+		s_pagesStillCompressed.FetchSub(1);
+}
+
+void CopyCompressedPage(const PageEntry& ent)
+{
+	if (IsCompressedPage(ent))
+		s_pagesStillCompressed.FetchAdd(1);
+}
+
+// Checks if a page is filled with a single byte, and gets that byte.
+static bool IsPageUniform(uintptr_t page, uint8_t& byte)
+{
+	const uint64_t* pData = (const uint64_t*)(Arch::GetHHDMOffset() + page);
+	
+	byte = (uint8_t)pData[0];
+	uint64_t pattern = byte * 0x0101010101010101ULL;
+	
+	for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++)
+	{
+		if (pData[i] != pattern)
+			return false;
+	}
+	
+	return true;
+}
+
+// Compresses the page an entry points to, if it's filled with a single byte. Returns true if it was compressed.
+static bool CompressPage(PageMapping* pPM, PageEntry& ent, uintptr_t addr)
+{
+	if (!ent.m_present || !ent.m_partOfPmm || ent.m_copyOnWrite)
+		return false;
+	
+	// Give pages that were used since the last pass another chance.
+	if (ent.m_accessed)
+	{
+		ent.m_accessed = false;
+		return false;
+	}
+	
+	uintptr_t page = ent.m_data & C_PAGE_ADDRESS_MASK;
+	
+	// Shared pages are still needed by someone else.
+	PMM::PageFrame* pFrame = PMM::GetPageFrame(page);
+	if (!pFrame || pFrame->m_refCount.Load() != 1)
+		return false;
+	
+	uint8_t byte;
+	if (!IsPageUniform(page, byte))
+		return false;
+	
+	PageEntry old = ent;
+	
+	PageEntry comp = old;
+	comp.m_present       = false;
+	comp.m_partOfPmm     = false;
+	comp.m_needAllocPage = true;
+	comp.m_accessed      = false;
+	comp.m_dirty         = false;
+	comp.m_faultAround   = 0;
+	comp.m_protKey       = 0;
+	comp.m_address       = C_COMPRESSED_PAGE_MARK | byte;
+	
+	// Counted before the entry is published, since it may be brought back and forgotten as soon as it is.
+	s_pagesStillCompressed.FetchAdd(1);
+	
+	SetEntry(ent, comp.m_data);
+	pPM->FlushTLB(addr);
+	
+	// The page could have been written to before the entry was flushed, so check again now that nobody can reach it.
+	uint8_t byteAfter;
+	if (!IsPageUniform(page, byteAfter) || byteAfter != byte)
+	{
+		// Only roll back if the entry wasn't faulted in or replaced in the meantime. If it was, the page is
+		// unreachable now, and whoever changed the entry has already forgotten the compressed page.
+		uint64_t expected = comp.m_data;
+		if (__atomic_compare_exchange_n(&ent.m_data, &expected, old.m_data, false, ATOMIC_DEFAULT_MEMORDER, ATOMIC_DEFAULT_MEMORDER))
+			s_pagesStillCompressed.FetchSub(1);
+		else
+			PMM::FreePage(page);
+		
+		return false;
+	}
+	
+	PMM::FreePage(page);
+	
+	s_pagesCompressed.FetchAdd(1);
+	return true;
+}
+
+bool PageMapping::CompressPages(uintptr_t& cursor, size_t pageCount)
+{
+	constexpr uintptr_t mask = 0x1FF;
+	constexpr uintptr_t C_LOWER_HALF_END = (uintptr_t)P_USER_END << 39;
+	
+	uintptr_t addr = cursor;
+	
+	while (pageCount && addr < C_LOWER_HALF_END)
+	{
+		uintptr_t index_PML4 = (addr >> 39) & mask;
+		uintptr_t index_PML3 = (addr >> 30) & mask;
+		uintptr_t index_PML2 = (addr >> 21) & mask;
+		uintptr_t index_PML1 = (addr >> 12) & mask;
+		
+		// Skip over the levels that aren't there.
+		PML3* pml3 = GetPML3(index_PML4);
+		if (!pml3)
+		{
+			addr = (addr | ((1ULL << 39) - 1)) + 1;
+			continue;
+		}
+		
+		PageDirectory* pd = (pml3->m_entries[index_PML3].m_data & PE_PAGESIZE) ? NULL : pml3->GetPageDirectory(index_PML3);
+		if (!pd)
+		{
+			addr = (addr | ((1ULL << 30) - 1)) + 1;
+			continue;
+		}
+		
+		// Huge pages are left alone.
+		PageTable* pt = pd->GetPageTable(index_PML2);
+		if (!pt)
+		{
+			addr = (addr | ((1ULL << 21) - 1)) + 1;
+			continue;
+		}
+		
+		for (uintptr_t i = index_PML1; i < 512 && pageCount; i++)
+		{
+			CompressPage(this, pt->m_entries[i], addr);
+			addr += PAGE_SIZE;
+			pageCount--;
+		}
+	}
+	
+	if (addr >= C_LOWER_HALF_END)
+	{
+		cursor = 0;
+		return false;
+	}
+	
+	cursor = addr;
+	return true;
+}
+
+CompressStats GetCompressStats()
+{
+	CompressStats stats;
+	stats.m_pagesCompressed = s_pagesCompressed.Load();
+	stats.m_pagesRestored   = GetFaultStats().m_pagesRestored;
+	stats.m_bytesSaved      = s_pagesStillCompressed.Load() * PAGE_SIZE;
+	return stats;
+}
+
+} // namespace VMM
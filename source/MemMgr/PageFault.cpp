@@ -14,6 +14,167 @@
 #include <Arch.hpp>
 #include <MemoryManager.hpp>
 
+static Atomic<uint64_t> s_demandFaults;
+static Atomic<uint64_t> s_faultAroundPages;
+static Atomic<uint64_t> s_pagesRestored;
+
+VMM::FaultStats VMM::GetFaultStats()
+{
+	FaultStats stats;
+	stats.m_demandFaults     = s_demandFaults.Load();
+	stats.m_faultAroundPages = s_faultAroundPages.Load();
+	stats.m_pagesRestored    = s_pagesRestored.Load();
+	return stats;
+}
+
+// Gets the byte a demand paged entry's page is to be filled with.
+static uint8_t GetFillByte(const VMM::PageEntry* pPageEntry)
+{
+	if (pPageEntry->m_address & VMM::C_COMPRESSED_PAGE_MARK)
+		return pPageEntry->m_address & 0xFF;
+	
+	uint8_t nibble = pPageEntry->m_protKey & 0xF;
+	return nibble << 4 | nibble;
+}
+
+// Points a demand paged entry to a page, filling it with the entry's byte. If bZeroed is set, the page is already zeroed.
+// Returns false if the entry was faulted in or changed by someone else in the meantime, in which case the page is unused.
+static bool MaterializePage(VMM::PageEntry* pPageEntry, uintptr_t page, bool bZeroed)
+{
+	// Other CPUs may fault on the same entry, or unmap it, at the same time. So work on a copy, and only
+	// install the result if the entry still holds what we started from.
+	VMM::PageEntry old;
+	old.m_data = __atomic_load_n(&pPageEntry->m_data, ATOMIC_MEMORD_ACQUIRE);
+	
+	if (old.m_present || !old.m_needAllocPage)
+		return false;
+	
+	uint8_t someByte = GetFillByte(&old);
+	
+	// fill it with some byte
+	if (someByte != 0 || !bZeroed)
+		memset((void*)(Arch::GetHHDMOffset() + page), someByte, PAGE_SIZE);
+	
+	// make it present now
+	VMM::PageEntry ent = old;
+	ent.m_address       = page >> 12;
+	ent.m_needAllocPage = false;
+	ent.m_partOfPmm     = true;
+	ent.m_present       = true;
+	
+	uint64_t expected = old.m_data;
+	if (!__atomic_compare_exchange_n(&pPageEntry->m_data, &expected, ent.m_data, false, ATOMIC_MEMORD_ACQ_REL, ATOMIC_MEMORD_ACQUIRE))
+		return false;
+	
+	if (old.m_address & VMM::C_COMPRESSED_PAGE_MARK)
+		s_pagesRestored.FetchAdd(1);
+	
+	VMM::ForgetCompressedPage(old);
+	return true;
+}
+
+// Allocates the page of a demand paged entry. If the entry has a fault around window, the demand paged entries
+// that follow it in the same page table are allocated too, with a single batched allocation.
+// Returns false if we're out of memory.
+static bool AllocateDemandPages(VMM::PageEntry* pPageEntry, int index)
+{
+	using namespace VMM;
+	
+	PageEntry* pEntries[C_MAX_FAULT_AROUND + 1];
+	size_t count = 0;
+	
+	pEntries[count++] = pPageEntry;
+	
+	int end = index + 1 + pPageEntry->m_faultAround;
+	if (end > 512)
+		end = 512;
+	
+	for (int i = index + 1; i < end; i++)
+	{
+		PageEntry* pEnt = pPageEntry + (i - index);
+		if (!pEnt->m_present && pEnt->m_needAllocPage)
+			pEntries[count++] = pEnt;
+	}
+	
+	s_demandFaults.FetchAdd(1);
+	
+	if (count == 1)
+	{
+		// If it's going to be filled with zeroes, a pre-zeroed page saves us the trouble.
+		bool bZeroed = GetFillByte(pPageEntry) == 0;
+		
+		uintptr_t page = bZeroed ? PMM::AllocateZeroedPage() : PMM::AllocatePage();
+		if (page == PMM::INVALID_PAGE)
+			return false;
+		
+		// If someone else got to it first, their page is the one that stays.
+		if (!MaterializePage(pPageEntry, page, bZeroed))
+			PMM::FreePage(page);
+		
+		return true;
+	}
+	
+	uintptr_t pages[C_MAX_FAULT_AROUND + 1];
+	size_t got = PMM::AllocatePages(count, pages);
+	if (got == 0)
+		return false;
+	
+	// If we didn't get all of them, just populate as many as we can, starting with the one that faulted.
+	// The pages of the entries someone else got to first are given back.
+	uintptr_t unused[C_MAX_FAULT_AROUND + 1];
+	size_t unusedCount = 0, faultAroundCount = 0;
+	
+	for (size_t i = 0; i < got; i++)
+	{
+		if (!MaterializePage(pEntries[i], pages[i], false))
+			unused[unusedCount++] = pages[i];
+		else if (i != 0)
+			faultAroundCount++;
+	}
+	
+	PMM::FreePages(unused, unusedCount);
+	
+	s_faultAroundPages.FetchAdd(faultAroundCount);
+	return true;
+}
+
+// Gives a copy on write page entry its own copy of the page, or takes over the page if nobody else is using it anymore.
+// Returns false if we're out of memory.
+static bool BreakCopyOnWrite(VMM::PageEntry* pPageEntry, bool bHuge)
+{
+	uintptr_t oldPage = pPageEntry->m_data & VMM::C_PAGE_ADDRESS_MASK;
+	int       order   = bHuge ? HUGE_PAGE_ORDER : 0;
+	
+	// Bit 12 is the PAT bit for huge pages.
+	uint64_t  patBit  = 0;
+	if (bHuge)
+	{
+		patBit   = pPageEntry->m_data & VMM::PE_PAT_HUGE;
+		oldPage &= ~(HUGE_PAGE_SIZE - 1);
+	}
+	
+	PMM::PageFrame* pFrame = PMM::GetPageFrame(oldPage);
+	
+	// If we're the only one left using this page, just take it over.
+	if (!pFrame || pFrame->m_refCount.Load() > 1)
+	{
+		uintptr_t newPage = PMM::AllocatePages(order);
+		if (newPage == PMM::INVALID_PAGE)
+			return false;
+		
+		memcpy((void*)(Arch::GetHHDMOffset() + newPage), (void*)(Arch::GetHHDMOffset() + oldPage), PAGE_SIZE << order);
+		
+		pPageEntry->m_data = (pPageEntry->m_data & ~VMM::C_PAGE_ADDRESS_MASK) | newPage | patBit;
+		
+		// Drop our reference to the old page.
+		PMM::FreePages(oldPage, order);
+	}
+	
+	pPageEntry->m_copyOnWrite = false;
+	pPageEntry->m_readWrite   = true;
+	return true;
+}
+
 void Arch::CPU::OnPageFault(Registers* pRegs)
 {
 	//SLogMsg("Page fault! CR2: %p  RIP: %p  ErrorCode: %p", pRegs->cr2, pRegs->rip, pRegs->error_code);
@@ -38,7 +199,8 @@ void Arch::CPU::OnPageFault(Registers* pRegs)
 	// Check if the accessed page is valid or not
 	PageMapping* pPM = PageMapping::GetFromCR3();
 	
-	PageEntry* pPageEntry = pPM->GetPageEntry(pRegs->cr2);
+	bool bHuge = false;
+	PageEntry* pPageEntry = pPM->GetPageEntry(pRegs->cr2, &bHuge);
 	
 	if (!pPageEntry)
 	{
@@ -57,24 +219,17 @@ void Arch::CPU::OnPageFault(Registers* pRegs)
 		// still not present.  Look into why that is.
 		if (pPageEntry->m_needAllocPage)
 		{
-			// ah hah! I see why that is now - we need to allocate a PMM page.
-			uintptr_t page = PMM::AllocatePage();
-			if (page == PMM::INVALID_PAGE)
+			// ah hah! I see why that is now - we need to allocate a PMM page. Huge pages
+			// don't take part in fault around, since they have no neighbouring entries.
+			int index = bHuge ? 511 : (pRegs->cr2 >> 12) & 0x1FF;
+			
+			if (!AllocateDemandPages(pPageEntry, index))
 			{
 				// Uh oh. We need to get rid of some pages, TODO
 				KernelPanic("TODO: out of memory, need to free some caches and stuff. CR2: %p  RIP: %p  ErrorCode: %p", pRegs->cr2, pRegs->rip, pRegs->error_code);
 			}
 			
-			// fill it with some byte
-			uint8_t someByte = (pPageEntry->m_protKey << 4 | pPageEntry->m_protKey);
-			memset((void*)(Arch::GetHHDMOffset() + page), someByte, PAGE_SIZE);
-			
-			// make it present now
-			pPageEntry->m_address = page >> 12;
-			pPageEntry->m_needAllocPage = false;
-			pPageEntry->m_partOfPmm     = true;
-			pPageEntry->m_present       = true;
-			
+			// The neighbouring entries weren't present, so they can't have been cached.
 			Arch::Invalidate(pRegs->cr2);
 			return;
 		}
@@ -86,7 +241,22 @@ void Arch::CPU::OnPageFault(Registers* pRegs)
 	// If the page was present but we have an access error...
 	if (errorCode.bWrite)
 	{
-		// TODO COW
+		// Maybe another CPU has already made it writable.
+		if (pPageEntry->m_readWrite)
+			return;
+		
+		if (pPageEntry->m_copyOnWrite)
+		{
+			if (!BreakCopyOnWrite(pPageEntry, bHuge))
+			{
+				// Uh oh. We need to get rid of some pages, TODO
+				KernelPanic("TODO: out of memory, need to free some caches and stuff. CR2: %p  RIP: %p  ErrorCode: %p", pRegs->cr2, pRegs->rip, pRegs->error_code);
+			}
+			
+			Arch::Invalidate(pRegs->cr2);
+			return;
+		}
+		
 		goto _INVALID_PAGE_FAULT;
 	}
 	
@@ -18,13 +18,31 @@ namespace VMM
 
 /**** Cloning ****/
 
-PageTable* PageTable::Clone()
+// Shares the page an entry points to with a clone. If it's writable, both entries are made read-only and copy on write.
+// Returns true if the original entry was modified.
+static bool ShareEntry(PageEntry& oldEnt, PageEntry& newEnt)
 {
-	uintptr_t pmPage = PMM::AllocatePage();
+	PMM::ReferencePage(oldEnt.m_address << 12);
+	
+	if (!oldEnt.m_readWrite)
+		return false;
+	
+	oldEnt.m_readWrite   = false;
+	oldEnt.m_copyOnWrite = true;
+	
+	newEnt = oldEnt;
+	return true;
+}
+
+PageTable* PageTable::Clone(PMM::PageBatch& batch, bool& bModified)
+{
+	uintptr_t pmPage = batch.Get();
 	
 	if (pmPage == PMM::INVALID_PAGE)
 		KernelPanic("Could not clone page table! (source/MemMgr/VMM.cpp:%d)", __LINE__);
 	
+	TrackPageTable(pmPage);
+	
 	// Allocate the PageTable itself.
 	PageTable* pNewPT = (PageTable*)(Arch::GetHHDMOffset() + pmPage);
 	memset(pNewPT, 0, sizeof *pNewPT);
@@ -33,47 +51,58 @@ PageTable* PageTable::Clone()
 	{
 		// Clone the page.
 		PageEntry& oldEnt = m_entries[i];
-		if (!oldEnt.m_present) continue;
-		
 		PageEntry newEnt = oldEnt;
 		
-		// if this is part of the PMM...
-		if (oldEnt.m_partOfPmm)
+		// if this is part of the PMM, share it.
+		if (oldEnt.m_present && oldEnt.m_partOfPmm)
 		{
-			// clone the page. TODO: Copy on write
-			uintptr_t newPage = PMM::AllocatePage();
-			if (pmPage == PMM::INVALID_PAGE)
-				KernelPanic("Could not clone page! (source/MemMgr/VMM.cpp:%d)", __LINE__);
-			
-			newEnt.m_address = newPage >> 12;
+			if (ShareEntry(oldEnt, newEnt))
+				bModified = true;
 		}
 		
-		pNewPT->m_entries[i].m_data = newEnt.m_data;
+		// Note: Pages that haven't been faulted in yet are copied too, they'll get their own page when they are.
+		// Compressed pages are counted once for every copy, since each of them is brought back on its own.
+		CopyCompressedPage(newEnt);
+		SetEntry(pNewPT->m_entries[i], newEnt.m_data);
 	}
 	
 	return pNewPT;
 }
 
-PageDirectory* PageDirectory::Clone()
+PageDirectory* PageDirectory::Clone(PMM::PageBatch& batch, bool& bModified)
 {
-	uintptr_t pmPage = PMM::AllocatePage();
+	uintptr_t pmPage = batch.Get();
 	
 	if (pmPage == PMM::INVALID_PAGE)
 		KernelPanic("Could not clone page directory! (source/MemMgr/VMM.cpp:%d)", __LINE__);
 	
+	TrackPageTable(pmPage);
+	
 	// Allocate the PageDirectory itself.
 	PageDirectory* pNewPD = (PageDirectory*)(Arch::GetHHDMOffset() + pmPage);
 	memset(pNewPD, 0, sizeof *pNewPD);
 	
 	for (int i = 0; i < 512; i++)
 	{
+		// If this is a huge page, clone it directly.
+		if (IsHugePage(i))
+		{
+			PageEntry entry = m_entries[i];
+			
+			if (entry.m_partOfPmm && ShareEntry(m_entries[i], entry))
+				bModified = true;
+			
+			SetEntry(pNewPD->m_entries[i], entry.m_data);
+			continue;
+		}
+		
 		PageTable* pOldPT = GetPageTable(i);
 		if (!pOldPT) continue;
 		
 		PageEntry& oldEnt = m_entries[i];
 		
 		// Clone the page table.
-		PageTable* pPT = pOldPT->Clone();
+		PageTable* pPT = pOldPT->Clone(batch, bModified);
 		if (!pPT) continue;
 		uintptr_t ptPhys = (uintptr_t)pPT - Arch::GetHHDMOffset();
 		
@@ -81,19 +110,21 @@ PageDirectory* PageDirectory::Clone()
 		PageEntry entry = oldEnt;
 		entry.m_address = ptPhys >> 12;
 		
-		pNewPD->m_entries[i].m_data = entry.m_data;
+		SetEntry(pNewPD->m_entries[i], entry.m_data);
 	}
 	
 	return pNewPD;
 }
 
-PML3* PML3::Clone()
+PML3* PML3::Clone(PMM::PageBatch& batch, bool& bModified)
 {
-	uintptr_t pmPage = PMM::AllocatePage();
+	uintptr_t pmPage = batch.Get();
 	
 	if (pmPage == PMM::INVALID_PAGE)
 		KernelPanic("Could not clone PML3! (source/MemMgr/VMM.cpp:%d)", __LINE__);
 	
+	TrackPageTable(pmPage);
+	
 	// Allocate the PML3 itself.
 	PML3* pNewPM = (PML3*)(Arch::GetHHDMOffset() + pmPage);
 	memset(pNewPM, 0, sizeof *pNewPM);
@@ -106,7 +137,7 @@ PML3* PML3::Clone()
 		PageEntry& oldEnt = m_entries[i];
 		
 		// Clone the page directory.
-		PageDirectory* pPD = pOldPD->Clone();
+		PageDirectory* pPD = pOldPD->Clone(batch, bModified);
 		if (!pPD) continue;
 		uintptr_t pdPhys = (uintptr_t)pPD - Arch::GetHHDMOffset();
 		
@@ -114,7 +145,7 @@ PML3* PML3::Clone()
 		PageEntry entry = oldEnt;
 		entry.m_address = pdPhys >> 12;
 		
-		pNewPM->m_entries[i].m_data = entry.m_data;
+		SetEntry(pNewPM->m_entries[i], entry.m_data);
 	}
 	
 	return pNewPM;
@@ -122,14 +153,23 @@ PML3* PML3::Clone()
 
 PageMapping* PageMapping::Clone(bool keepLowerHalf)
 {
-	uintptr_t pmPage = PMM::AllocatePage();
+	// Grab pages in batches, instead of taking the PMM locks for every single page.
+	PMM::PageBatch batch;
+	
+	// Whether any of our own entries were made read-only.
+	bool bModified = false;
+	
+	uintptr_t pmPage = batch.Get();
 	
 	if (pmPage == PMM::INVALID_PAGE)
 		KernelPanic("Could not clone page mapping! (source/MemMgr/VMM.cpp:%d)", __LINE__);
 	
+	TrackPageTable(pmPage);
+	
 	// Allocate the pagemapping itself.
 	PageMapping* pNewPM = (PageMapping*)(Arch::GetHHDMOffset() + pmPage);
 	memset(pNewPM, 0, sizeof *pNewPM);
+	pNewPM->BumpGeneration();
 	
 	// Look through the lower canonical half's PML3 entries and clone them recursively.
 	for (int i = P_USER_START; keepLowerHalf && i < P_USER_END; i++)
@@ -140,7 +180,7 @@ PageMapping* PageMapping::Clone(bool keepLowerHalf)
 		
 		PageEntry& oldEnt = m_entries[i];
 		
-		PML3* pPML3 = pOldPML3->Clone();
+		PML3* pPML3 = pOldPML3->Clone(batch, bModified);
 		if (!pPML3) continue;
 		uintptr_t pml4Phys = (uintptr_t)pPML3 - Arch::GetHHDMOffset();
 		
@@ -158,11 +198,15 @@ PageMapping* PageMapping::Clone(bool keepLowerHalf)
 		pNewPM->m_entries[i].m_data = oldEnt.m_data;
 	}
 	
-	using namespace Arch;
-	
-	CPU* pCpu = CPU::GetCurrent();
-	
-	
+	// If some of our pages were made read-only, flush them out of the TLB. If we aren't the current page mapping,
+	// they're cached under our PCID, so let every CPU know that it should flush them before switching to us.
+	if (bModified)
+	{
+		if (this == GetFromCR3())
+			Arch::WriteCR3(Arch::ReadCR3());
+		else
+			BumpGeneration();
+	}
 	
 	return pNewPM;
 }
@@ -0,0 +1,401 @@
+//  ***************************************************************
+//  PageMapRange.cpp - Creation date: 17/10/2023
+//  -------------------------------------------------------------
+//  NanoShell64 Copyright (C) 2023 - Licensed under GPL V3
+//
+//  ***************************************************************
+//  Programmer(s):  iProgramInCpp (iprogramincpp@gmail.com)
+//  ***************************************************************
+//  
+//  Module description:
+//      This module implements the page mapping's range functions.
+//    They walk the upper levels once per page table, instead of
+//    once per page.
+//
+//  ***************************************************************
+#include <Arch.hpp>
+
+namespace VMM
+{
+
+// The size of the range a page directory covers.
+constexpr uintptr_t C_PAGE_DIR_SPAN = 1ULL << 30;
+
+// The number of pages a page table covers.
+constexpr size_t C_PAGE_TABLE_PAGES = 512;
+
+// The flags ProtectRange is allowed to change.
+constexpr uint64_t C_PROTECT_FLAGS = PE_READWRITE | PE_SUPERVISOR | PE_WRITETHROUGH | PE_CACHEDISABLE | PE_PAT | PE_GLOBAL | PE_EXECUTEDISABLE;
+
+// Collects the pages unmapped from a range, so that they can be freed in bulk once no TLB has them cached anymore.
+class RangeReclaimer
+{
+public:
+	RangeReclaimer(PageMapping* pPM, uintptr_t start) : m_pPM(pPM), m_start(start >> 12), m_end(start >> 12) {}
+	
+	RangeReclaimer(const RangeReclaimer&) = delete;
+	RangeReclaimer& operator=(const RangeReclaimer&) = delete;
+	
+	~RangeReclaimer()
+	{
+		Flush();
+	}
+	
+	// Records that the entry of the page at an address was changed. The address must not be below the last one.
+	void Modified(uintptr_t addr, const PageEntry& old)
+	{
+		m_end = (addr >> 12) + 1;
+		
+		if (old.m_present)
+			m_bFlush = true;
+	}
+	
+	// Records that the entry of the page at an address was replaced, freeing the page it pointed to later.
+	void Replaced(uintptr_t addr, const PageEntry& old)
+	{
+		Modified(addr, old);
+		ForgetCompressedPage(old);
+		
+		if (old.m_present && old.m_partOfPmm)
+			FreeLater(old.m_address << 12);
+	}
+	
+	// Records that the entry of a huge page at an address was replaced, freeing the block it pointed to later.
+	void ReplacedHuge(uintptr_t addr, const PageEntry& old)
+	{
+		Modified(addr + HUGE_PAGE_SIZE - PAGE_SIZE, old);
+		
+		if (!old.m_present || !old.m_partOfPmm)
+			return;
+		
+		if (m_blockCount == C_MAX_BLOCKS)
+			Flush();
+		
+		// Bit 12 of a huge page entry is its PAT bit, not a part of the address.
+		m_blocks[m_blockCount++] = old.m_data & C_PAGE_ADDRESS_MASK & ~(HUGE_PAGE_SIZE - 1);
+	}
+	
+	// Records that a paging structure covering the last recorded page was detached, freeing it later.
+	void Detached(uintptr_t page)
+	{
+		// The CPU may have cached walks through the structure, even if none of its entries were present.
+		m_bFlush = true;
+		
+		UntrackPageTable(page);
+		FreeLater(page);
+	}
+	
+	void Flush()
+	{
+		if (m_bFlush && m_end > m_start)
+			m_pPM->FlushTLB(m_start << 12, m_end - m_start);
+		
+		m_bFlush = false;
+		m_start  = m_end;
+		
+		PMM::FreePages(m_pages, m_pageCount);
+		m_pageCount = 0;
+		
+		for (size_t i = 0; i < m_blockCount; i++)
+			PMM::FreePages(m_blocks[i], HUGE_PAGE_ORDER);
+		
+		m_blockCount = 0;
+	}
+	
+private:
+	void FreeLater(uintptr_t page)
+	{
+		if (m_pageCount == C_MAX_PAGES)
+			Flush();
+		
+		m_pages[m_pageCount++] = page;
+	}
+	
+	static constexpr size_t C_MAX_PAGES  = 64;
+	static constexpr size_t C_MAX_BLOCKS = 16;
+	
+	PageMapping* m_pPM;
+	
+	// The page numbers of the range that may still be cached. Page numbers are used so that
+	// a range ending at the top of the address space doesn't overflow.
+	uintptr_t m_start, m_end;
+	bool m_bFlush = false;
+	
+	uintptr_t m_pages[C_MAX_PAGES];
+	size_t m_pageCount = 0;
+	
+	// The huge page blocks to free.
+	uintptr_t m_blocks[C_MAX_BLOCKS];
+	size_t m_blockCount = 0;
+};
+
+// Clears the entry of a huge page, leaving the TLB flush and the freeing of its block to the reclaimer.
+static void ClearHugePage(PageDirectory* pd, uintptr_t index, uintptr_t addr, RangeReclaimer& reclaimer)
+{
+	PageEntry& pde = pd->m_entries[index];
+	PageEntry old = pde;
+	
+	SetEntry(pde, 0);
+	reclaimer.ReplacedHuge(addr, old);
+}
+
+// Gets the number of pages until the end of the page directory, or the range, whichever comes first.
+static size_t PagesUntilNextPageDir(uintptr_t addr, size_t pageCount)
+{
+	size_t pages = (C_PAGE_DIR_SPAN - (addr & (C_PAGE_DIR_SPAN - 1))) / PAGE_SIZE;
+	return pages < pageCount ? pages : pageCount;
+}
+
+// Gets the number of pages until the end of the page table, or the range, whichever comes first.
+static size_t PagesUntilNextPageTable(uintptr_t addr, size_t pageCount)
+{
+	size_t pages = C_PAGE_TABLE_PAGES - ((addr >> 12) & 0x1FF);
+	return pages < pageCount ? pages : pageCount;
+}
+
+// Changes the flags of an entry. If it's being made writable, but the page is shared, it's made copy on write instead.
+// If bHuge is set, the entry maps a huge page, whose bit 12 is its PAT bit rather than a part of the address.
+static uint64_t ProtectEntry(uint64_t data, uint64_t set, uint64_t clear, bool bHuge = false)
+{
+	bool bWritable = (data & (PE_READWRITE | PE_COPYONWRITE)) != 0;
+	
+	if (clear & PE_READWRITE)
+		bWritable = false;
+	if (set & PE_READWRITE)
+		bWritable = true;
+	
+	data = (data & ~(clear | PE_READWRITE | PE_COPYONWRITE)) | (set & ~PE_READWRITE);
+	
+	if (!bWritable)
+		return data;
+	
+	uint64_t addressMask = C_PAGE_ADDRESS_MASK;
+	if (bHuge)
+		addressMask &= ~(HUGE_PAGE_SIZE - 1);
+	
+	PMM::PageFrame* pFrame = NULL;
+	if ((data & PE_PRESENT) && (data & PE_PARTOFPMM))
+		pFrame = PMM::GetPageFrame(data & addressMask);
+	
+	if (pFrame && pFrame->m_refCount.Load() > 1)
+		return data | PE_COPYONWRITE;
+	
+	return data | PE_READWRITE;
+}
+
+bool PageMapping::MapRange(uintptr_t addr, size_t pageCount, const PageEntry & pe, bool bContiguous)
+{
+	constexpr uintptr_t mask = 0x1FF;
+	
+	PageEntry ent = pe;
+	RangeReclaimer reclaimer(this, addr);
+	
+	PageDirectory* pd = NULL;
+	
+	while (pageCount)
+	{
+		uintptr_t index_PML2 = (addr >> 21) & mask;
+		uintptr_t index_PML1 = (addr >> 12) & mask;
+		
+		size_t run = PagesUntilNextPageTable(addr, pageCount);
+		
+		// Only walk the upper levels when entering a new page directory.
+		if (!pd || index_PML2 == 0)
+		{
+			pd = GetOrAllocPageDirectory(addr);
+			if (!pd) return false;
+		}
+		
+		if (pd->IsHugePage(index_PML2))
+		{
+			// If the whole huge page is being replaced, there's no need to split it up first.
+			if (run == C_PAGE_TABLE_PAGES)
+				ClearHugePage(pd, index_PML2, addr, reclaimer);
+			else if (!SplitHugePage(addr))
+				return false;
+		}
+		
+		PageTable* pt = pd->GetOrAllocPageTable(index_PML2);
+		if (!pt) return false;
+		
+		for (size_t i = index_PML1; i < index_PML1 + run; i++)
+		{
+			PageEntry old = pt->m_entries[i];
+			SetEntry(pt->m_entries[i], ent.m_data);
+			reclaimer.Replaced(addr, old);
+			
+			if (bContiguous)
+				ent.m_address++;
+			
+			addr += PAGE_SIZE;
+		}
+		
+		pageCount -= run;
+	}
+	
+	return true;
+}
+
+void PageMapping::UnmapRange(uintptr_t addr, size_t pageCount)
+{
+	constexpr uintptr_t mask = 0x1FF;
+	
+	RangeReclaimer reclaimer(this, addr);
+	
+	PageDirectory* pd = NULL;
+	bool bLookUp = true;
+	
+	while (pageCount)
+	{
+		uintptr_t index_PML2 = (addr >> 21) & mask;
+		uintptr_t index_PML1 = (addr >> 12) & mask;
+		
+		// Only walk the upper levels when entering a new page directory.
+		if (bLookUp || index_PML2 == 0)
+		{
+			pd = GetPageDirectory(addr);
+			bLookUp = false;
+			
+			if (!pd)
+			{
+				// Nothing is mapped until the next page directory.
+				size_t skip = PagesUntilNextPageDir(addr, pageCount);
+				addr += skip * PAGE_SIZE;
+				pageCount -= skip;
+				bLookUp = true;
+				continue;
+			}
+		}
+		
+		size_t run = PagesUntilNextPageTable(addr, pageCount);
+		
+		if (pd->IsHugePage(index_PML2))
+		{
+			if (run == C_PAGE_TABLE_PAGES)
+			{
+				ClearHugePage(pd, index_PML2, addr, reclaimer);
+				addr += run * PAGE_SIZE;
+				pageCount -= run;
+				continue;
+			}
+			
+			if (!SplitHugePage(addr))
+			{
+				SLogMsg("Could not split up huge page at %p to unmap a range", addr);
+				addr += run * PAGE_SIZE;
+				pageCount -= run;
+				continue;
+			}
+		}
+		
+		PageTable* pt = pd->GetPageTable(index_PML2);
+		if (pt)
+		{
+			for (size_t i = index_PML1; i < index_PML1 + run; i++)
+			{
+				PageEntry old = pt->m_entries[i];
+				SetEntry(pt->m_entries[i], 0);
+				reclaimer.Replaced(addr + (i - index_PML1) * PAGE_SIZE, old);
+			}
+			
+			// Free the page table, and the levels above it, if they're now empty.
+			uintptr_t tables[3];
+			int tableCount = DetachEmptyLevels(addr, tables);
+			
+			for (int i = 0; i < tableCount; i++)
+				reclaimer.Detached(tables[i]);
+			
+			// If the page directory was detached, look it up again.
+			if (tableCount > 1)
+				bLookUp = true;
+		}
+		
+		addr += run * PAGE_SIZE;
+		pageCount -= run;
+	}
+}
+
+void PageMapping::ProtectRange(uintptr_t addr, size_t pageCount, uint64_t set, uint64_t clear)
+{
+	constexpr uintptr_t mask = 0x1FF;
+	
+	set   &= C_PROTECT_FLAGS;
+	clear &= C_PROTECT_FLAGS;
+	
+	RangeReclaimer reclaimer(this, addr);
+	
+	PageDirectory* pd = NULL;
+	bool bLookUp = true;
+	
+	while (pageCount)
+	{
+		uintptr_t index_PML2 = (addr >> 21) & mask;
+		uintptr_t index_PML1 = (addr >> 12) & mask;
+		
+		// Only walk the upper levels when entering a new page directory.
+		if (bLookUp || index_PML2 == 0)
+		{
+			pd = GetPageDirectory(addr);
+			bLookUp = false;
+			
+			if (!pd)
+			{
+				// Nothing is mapped until the next page directory.
+				size_t skip = PagesUntilNextPageDir(addr, pageCount);
+				addr += skip * PAGE_SIZE;
+				pageCount -= skip;
+				bLookUp = true;
+				continue;
+			}
+		}
+		
+		size_t run = PagesUntilNextPageTable(addr, pageCount);
+		
+		if (pd->IsHugePage(index_PML2))
+		{
+			if (run == C_PAGE_TABLE_PAGES)
+			{
+				// The PAT bit of a huge page is bit 12 instead of bit 7, which holds the page size.
+				uint64_t hugeSet   = (set   & ~PE_PAT) | ((set   & PE_PAT) ? PE_PAT_HUGE : 0);
+				uint64_t hugeClear = (clear & ~PE_PAT) | ((clear & PE_PAT) ? PE_PAT_HUGE : 0);
+				
+				PageEntry& pde = pd->m_entries[index_PML2];
+				PageEntry old = pde;
+				pde.m_data = ProtectEntry(pde.m_data, hugeSet, hugeClear, true);
+				reclaimer.Modified(addr + HUGE_PAGE_SIZE - PAGE_SIZE, old);
+				
+				addr += run * PAGE_SIZE;
+				pageCount -= run;
+				continue;
+			}
+			
+			if (!SplitHugePage(addr))
+			{
+				SLogMsg("Could not split up huge page at %p to protect a range", addr);
+				addr += run * PAGE_SIZE;
+				pageCount -= run;
+				continue;
+			}
+		}
+		
+		PageTable* pt = pd->GetPageTable(index_PML2);
+		if (pt)
+		{
+			for (size_t i = index_PML1; i < index_PML1 + run; i++)
+			{
+				PageEntry& ent = pt->m_entries[i];
+				if (!ent.m_present && !ent.m_needAllocPage)
+					continue;
+				
+				PageEntry old = ent;
+				ent.m_data = ProtectEntry(ent.m_data, set, clear);
+				reclaimer.Modified(addr + (i - index_PML1) * PAGE_SIZE, old);
+			}
+		}
+		
+		addr += run * PAGE_SIZE;
+		pageCount -= run;
+	}
+}
+
+} // namespace VMM
@@ -0,0 +1,341 @@
+//  ***************************************************************
+//  Slab.cpp - Creation date: 17/10/2023
+//  -------------------------------------------------------------
+//  NanoShell64 Copyright (C) 2023 - Licensed under GPL V3
+//
+//  ***************************************************************
+//  Programmer(s):  iProgramInCpp (iprogramincpp@gmail.com)
+//  ***************************************************************
+//  
+//  Module description:
+//      This module implements the slab allocator, which serves
+//    the small allocations that would otherwise have to walk the
+//    kernel heap's free list.
+//      Each slab is a block of 4 pages accessed through the HHDM.
+//    It starts with a header holding a bitmap of the objects in
+//    use, followed by the objects themselves.
+//      Every CPU has its own arena of slab caches. Blocks freed by
+//    another CPU are handed back to the owner through a lock-free
+//    list, instead of touching its caches.
+//
+//  ***************************************************************
+#include <Arch.hpp>
+
+using namespace VMM;
+
+// The order of the blocks the slabs are carved out of. Since blocks are aligned to their size, the slab
+// an object belongs to can be found by rounding its address down.
+constexpr int    C_SLAB_ORDER = 2;
+constexpr size_t C_SLAB_SIZE  = PAGE_SIZE << C_SLAB_ORDER;
+
+constexpr size_t C_MAX_OBJECTS = C_SLAB_SIZE / SlabAllocator::C_MIN_SIZE;
+
+constexpr uint64_t C_SLAB_MAGIC = 0x3d9f1c5b7e20a864;
+
+struct VMM::Slab
+{
+	uint64_t   m_magic;
+	SlabCache* m_pCache;
+	Slab*      m_next;
+	Slab*      m_prev;
+	size_t     m_usedCount;
+	
+	// A set bit means the object is in use. The bits past the last object are always set.
+	uint64_t   m_bitmap[C_MAX_OBJECTS / 64];
+	
+	// A set bit means the object was handed back by another CPU, and is waiting in its arena's remote free list.
+	uint64_t   m_remoteBitmap[C_MAX_OBJECTS / 64];
+};
+
+// The objects start right after the header, keeping them 16 byte aligned.
+constexpr size_t C_SLAB_HEADER_SIZE = (sizeof(Slab) + 15) & ~15;
+
+// The arena used before the CPUs are set up. Since it has no owner to drain a remote free list,
+// it's always accessed with its lock held instead.
+static SlabArena s_bootArena;
+static Spinlock  s_bootArenaLock;
+
+SlabArena::SlabArena() : m_remoteFree(nullptr)
+{
+	for (int i = 0; i < SlabAllocator::C_SIZE_CLASS_COUNT; i++)
+	{
+		SlabCache& cache = m_caches[i];
+		cache.m_pArena   = this;
+		cache.m_objSize  = SlabAllocator::C_MIN_SIZE << i;
+		cache.m_objCount = (C_SLAB_SIZE - C_SLAB_HEADER_SIZE) / cache.m_objSize;
+		cache.m_pPartial = nullptr;
+		cache.m_pEmpty   = nullptr;
+	}
+}
+
+static int GetSizeClass(size_t size)
+{
+	if (size <= SlabAllocator::C_MIN_SIZE)
+		return 0;
+	
+	// The number of bits needed to represent size - 1, minus the 4 bits of the smallest class.
+	return 64 - __builtin_clzll(size - 1) - 4;
+}
+
+static uint8_t* GetObjects(Slab* pSlab)
+{
+	return (uint8_t*)pSlab + C_SLAB_HEADER_SIZE;
+}
+
+static void LinkPartial(SlabCache& cache, Slab* pSlab)
+{
+	pSlab->m_prev = nullptr;
+	pSlab->m_next = cache.m_pPartial;
+	if (cache.m_pPartial)
+		cache.m_pPartial->m_prev = pSlab;
+	cache.m_pPartial = pSlab;
+}
+
+static void UnlinkPartial(SlabCache& cache, Slab* pSlab)
+{
+	if (pSlab->m_prev)
+		pSlab->m_prev->m_next = pSlab->m_next;
+	else
+		cache.m_pPartial = pSlab->m_next;
+	
+	if (pSlab->m_next)
+		pSlab->m_next->m_prev = pSlab->m_prev;
+	
+	pSlab->m_next = pSlab->m_prev = nullptr;
+}
+
+static Slab* CreateSlab(SlabCache& cache)
+{
+	uintptr_t block = PMM::AllocatePages(C_SLAB_ORDER);
+	if (block == PMM::INVALID_PAGE)
+		return nullptr;
+	
+	PMM::GetPageFrame(block)->m_flags |= PMM::PF_SLAB;
+	
+	Slab* pSlab = (Slab*)(Arch::GetHHDMOffset() + block);
+	pSlab->m_magic     = C_SLAB_MAGIC;
+	pSlab->m_pCache    = &cache;
+	pSlab->m_next      = nullptr;
+	pSlab->m_prev      = nullptr;
+	pSlab->m_usedCount = 0;
+	
+	memset(pSlab->m_bitmap,       0, sizeof pSlab->m_bitmap);
+	memset(pSlab->m_remoteBitmap, 0, sizeof pSlab->m_remoteBitmap);
+	
+	// Mark the bits past the last object as used, so that they're never handed out.
+	for (size_t i = cache.m_objCount; i < C_MAX_OBJECTS; i++)
+		pSlab->m_bitmap[i / 64] |= 1ULL << (i % 64);
+	
+	return pSlab;
+}
+
+static void DestroySlab(Slab* pSlab)
+{
+	uintptr_t block = (uintptr_t)pSlab - Arch::GetHHDMOffset();
+	
+	pSlab->m_magic = 0;
+	PMM::GetPageFrame(block)->m_flags &= ~PMM::PF_SLAB;
+	
+	PMM::FreePages(block, C_SLAB_ORDER);
+}
+
+static void* AllocateFromCache(SlabCache& cache)
+{
+	Slab* pSlab = cache.m_pPartial;
+	if (!pSlab)
+	{
+		pSlab = cache.m_pEmpty;
+		cache.m_pEmpty = nullptr;
+		
+		if (!pSlab)
+			pSlab = CreateSlab(cache);
+		
+		if (!pSlab)
+			return nullptr;
+		
+		LinkPartial(cache, pSlab);
+	}
+	
+	// Slabs in the partial list always have a free object.
+	size_t index = 0;
+	for (size_t i = 0; i < C_MAX_OBJECTS / 64; i++)
+	{
+		if (pSlab->m_bitmap[i] == ~0ULL)
+			continue;
+		
+		int bit = __builtin_ctzll(~pSlab->m_bitmap[i]);
+		pSlab->m_bitmap[i] |= 1ULL << bit;
+		index = i * 64 + bit;
+		break;
+	}
+	
+	if (++pSlab->m_usedCount == cache.m_objCount)
+		UnlinkPartial(cache, pSlab);
+	
+	return GetObjects(pSlab) + index * cache.m_objSize;
+}
+
+// Gets the slab a block belongs to. Returns NULL if it isn't part of a slab.
+static Slab* GetSlab(void* pMem)
+{
+	uintptr_t addr = (uintptr_t)pMem;
+	uintptr_t hhdm = Arch::GetHHDMOffset();
+	
+	if (addr < hhdm)
+		return nullptr;
+	
+	uintptr_t block = (addr - hhdm) & ~(C_SLAB_SIZE - 1);
+	
+	PMM::PageFrame* pFrame = PMM::GetPageFrame(block);
+	if (!pFrame || !(pFrame->m_flags & PMM::PF_SLAB))
+		return nullptr;
+	
+	return (Slab*)(hhdm + block);
+}
+
+// Gets the index of the object a block is, if it's one of the slab's allocated objects.
+static bool GetAllocatedIndex(Slab* pSlab, void* pMem, size_t& index)
+{
+	SlabCache& cache = *pSlab->m_pCache;
+	
+	uintptr_t addr = (uintptr_t)pMem;
+	size_t offset = addr - (uintptr_t)GetObjects(pSlab);
+	index = offset / cache.m_objSize;
+	
+	if (addr < (uintptr_t)GetObjects(pSlab) || offset % cache.m_objSize || index >= cache.m_objCount)
+		return false;
+	
+	// Other CPUs may look at this while the owner changes it.
+	return __atomic_load_n(&pSlab->m_bitmap[index / 64], ATOMIC_MEMORD_RELAXED) & (1ULL << (index % 64));
+}
+
+// Frees a block into its slab. Only the owner of the slab's arena may do this.
+static void FreeToSlab(Slab* pSlab, void* pMem)
+{
+	SlabCache& cache = *pSlab->m_pCache;
+	
+	size_t index;
+	if (!GetAllocatedIndex(pSlab, pMem, index))
+	{
+		SLogMsg("ERROR: attempt to free region %p from slab %p that wasn't actually allocated. RA: %p", pMem, pSlab, __builtin_return_address(0));
+		return;
+	}
+	
+	pSlab->m_bitmap[index / 64] &= ~(1ULL << (index % 64));
+	__atomic_fetch_and(&pSlab->m_remoteBitmap[index / 64], ~(1ULL << (index % 64)), ATOMIC_MEMORD_RELAXED);
+	
+	// A full slab isn't in the partial list, so put it back.
+	if (pSlab->m_usedCount-- == cache.m_objCount)
+		LinkPartial(cache, pSlab);
+	
+	if (pSlab->m_usedCount == 0)
+	{
+		UnlinkPartial(cache, pSlab);
+		
+		if (!cache.m_pEmpty)
+			cache.m_pEmpty = pSlab;
+		else
+			DestroySlab(pSlab);
+	}
+}
+
+// Frees the blocks other CPUs have handed back to an arena. Only the owner of the arena may do this.
+static void DrainRemoteFrees(SlabArena& arena)
+{
+	if (!arena.m_remoteFree.Load(ATOMIC_MEMORD_RELAXED))
+		return;
+	
+	void* pMem = arena.m_remoteFree.Exchange(nullptr, ATOMIC_MEMORD_ACQUIRE);
+	while (pMem)
+	{
+		void* pNext = *(void**)pMem;
+		FreeToSlab(GetSlab(pMem), pMem);
+		pMem = pNext;
+	}
+}
+
+// Hands a block back to the CPU that owns its arena.
+static void PushRemoteFree(SlabArena& arena, Slab* pSlab, void* pMem)
+{
+	size_t index;
+	if (!GetAllocatedIndex(pSlab, pMem, index))
+	{
+		SLogMsg("ERROR: attempt to free region %p from slab %p that wasn't actually allocated. RA: %p", pMem, pSlab, __builtin_return_address(0));
+		return;
+	}
+	
+	// Freeing a block again before the owner gets to it would link it into the list twice, and loop it.
+	uint64_t bit = 1ULL << (index % 64);
+	if (__atomic_fetch_or(&pSlab->m_remoteBitmap[index / 64], bit, ATOMIC_DEFAULT_MEMORDER) & bit)
+	{
+		SLogMsg("ERROR: region %p from slab %p was freed twice. RA: %p", pMem, pSlab, __builtin_return_address(0));
+		return;
+	}
+	
+	void* pHead = arena.m_remoteFree.Load(ATOMIC_MEMORD_RELAXED);
+	
+	do
+		*(void**)pMem = pHead;
+	while (!arena.m_remoteFree.CompareExchange(&pHead, pMem, true, ATOMIC_MEMORD_RELEASE, ATOMIC_MEMORD_RELAXED));
+}
+
+void* SlabAllocator::Allocate(size_t size)
+{
+	if (size > C_MAX_SIZE)
+		return nullptr;
+	
+	int sizeClass = GetSizeClass(size);
+	
+	Arch::CPU* pCpu = Arch::CPU::GetCurrent();
+	if (!pCpu)
+	{
+		LockGuard lg(s_bootArenaLock);
+		return AllocateFromCache(s_bootArena.m_caches[sizeClass]);
+	}
+	
+	// Disable interrupts, so that nothing else on this CPU touches the arena while we do.
+	bool bState = pCpu->SetInterruptsEnabled(false);
+	
+	SlabArena& arena = *pCpu->GetSlabArena();
+	DrainRemoteFrees(arena);
+	
+	void* pMem = AllocateFromCache(arena.m_caches[sizeClass]);
+	
+	pCpu->SetInterruptsEnabled(bState);
+	return pMem;
+}
+
+bool SlabAllocator::Free(void* pMem)
+{
+	Slab* pSlab = GetSlab(pMem);
+	if (!pSlab)
+		return false;
+	
+	if (pSlab->m_magic != C_SLAB_MAGIC)
+	{
+		SLogMsg("ERROR: slab %p is corrupted (its magic number is %p). RA: %p", pSlab, pSlab->m_magic, __builtin_return_address(0));
+		return true;
+	}
+	
+	SlabArena& arena = *pSlab->m_pCache->m_pArena;
+	
+	if (&arena == &s_bootArena)
+	{
+		LockGuard lg(s_bootArenaLock);
+		FreeToSlab(pSlab, pMem);
+		return true;
+	}
+	
+	Arch::CPU* pCpu = Arch::CPU::GetCurrent();
+	if (!pCpu || pCpu->GetSlabArena() != &arena)
+	{
+		PushRemoteFree(arena, pSlab, pMem);
+		return true;
+	}
+	
+	bool bState = pCpu->SetInterruptsEnabled(false);
+	FreeToSlab(pSlab, pMem);
+	pCpu->SetInterruptsEnabled(bState);
+	
+	return true;
+}
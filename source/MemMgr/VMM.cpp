@@ -22,7 +22,7 @@ namespace VMM
 
 PageTable* PageDirectory::GetPageTable(int index)
 {
-	if (!m_entries[index].m_present) return NULL;
+	if (!m_entries[index].m_present || (m_entries[index].m_data & PE_PAGESIZE)) return NULL;
 	return (PageTable*)(Arch::GetHHDMOffset() + PAGE_SIZE * (m_entries[index].m_address));
 }
 
@@ -40,7 +40,136 @@ PML3* PageMapping::GetPML3(int index)
 
 PageMapping* PageMapping::GetFromCR3()
 {
-	return (PageMapping*)(Arch::GetHHDMOffset() + Arch::ReadCR3());
+	return (PageMapping*)(Arch::GetHHDMOffset() + (Arch::ReadCR3() & C_PAGE_ADDRESS_MASK));
+}
+
+/**** Paging structures ****/
+
+static Atomic<uint64_t> s_pageTablePages;
+
+uintptr_t AllocatePageTable()
+{
+	uintptr_t page = PMM::AllocateZeroedPage();
+	if (page == PMM::INVALID_PAGE)
+		return page;
+	
+	TrackPageTable(page);
+	return page;
+}
+
+void TrackPageTable(uintptr_t page)
+{
+	PMM::PageFrame* pFrame = PMM::GetPageFrame(page);
+	if (pFrame)
+		pFrame->m_usedEntries = 0;
+	
+	s_pageTablePages.FetchAdd(1);
+}
+
+void UntrackPageTable(uintptr_t)
+{
+	s_pageTablePages.FetchSub(1);
+}
+
+void FreePageTable(uintptr_t page)
+{
+	UntrackPageTable(page);
+	PMM::FreePage(page);
+}
+
+uint64_t GetPageTablePages()
+{
+	return s_pageTablePages.Load();
+}
+
+// Updates the count of used entries of the table an entry is in, after it started or stopped being used.
+static void CountEntry(PageEntry& ent, bool bIsUsed)
+{
+	// The tables the bootloader gave us aren't part of the PMM, so they aren't counted.
+	PMM::PageFrame* pFrame = PMM::GetPageFrame(((uintptr_t)&ent - Arch::GetHHDMOffset()) & ~(PAGE_SIZE - 1));
+	if (!pFrame)
+		return;
+	
+	// The tables of the kernel half are shared, so other CPUs may be changing other entries of the same table.
+	if (bIsUsed)
+		__atomic_fetch_add(&pFrame->m_usedEntries, 1, ATOMIC_MEMORD_RELAXED);
+	else
+		__atomic_fetch_sub(&pFrame->m_usedEntries, 1, ATOMIC_MEMORD_RELAXED);
+}
+
+void SetEntry(PageEntry& ent, uint64_t data)
+{
+	bool bWasUsed = ent.m_data != 0, bIsUsed = data != 0;
+	
+	ent.m_data = data;
+	
+	if (bWasUsed != bIsUsed)
+		CountEntry(ent, bIsUsed);
+}
+
+// Points an entry that isn't present to a new paging structure. The kernel half is shared by every CPU, so
+// another one may fill in the same entry first. Returns false if it did, in which case the page wasn't used.
+static bool InstallTable(PageEntry& ent, uintptr_t page)
+{
+	uint64_t old = __atomic_load_n(&ent.m_data, ATOMIC_MEMORD_ACQUIRE);
+	if (old & PE_PRESENT)
+		return false;
+	
+	uint64_t data = PageEntry(page, PE_PRESENT | PE_READWRITE | PE_PARTOFPMM).m_data;
+	if (!__atomic_compare_exchange_n(&ent.m_data, &old, data, false, ATOMIC_MEMORD_ACQ_REL, ATOMIC_MEMORD_ACQUIRE))
+		return false;
+	
+	if (old == 0)
+		CountEntry(ent, true);
+	
+	return true;
+}
+
+// Checks if the paging structure an entry points to may be freed, because none of its entries are in use.
+static bool IsTableEmpty(const PageEntry& ent)
+{
+	if (!ent.m_present || !ent.m_partOfPmm)
+		return false;
+	
+	PMM::PageFrame* pFrame = PMM::GetPageFrame(ent.m_address << 12);
+	return pFrame && pFrame->m_usedEntries == 0;
+}
+
+int PageMapping::DetachEmptyLevels(uintptr_t addr, uintptr_t pTables[3])
+{
+	constexpr uintptr_t mask = 0x1FF;
+	uintptr_t index_PML4 = (addr >> 39) & mask;
+	uintptr_t index_PML3 = (addr >> 30) & mask;
+	uintptr_t index_PML2 = (addr >> 21) & mask;
+	
+	PML3          *pml3 =       GetPML3         (index_PML4); if (!pml3) return 0;
+	PageDirectory *pml2 = pml3->GetPageDirectory(index_PML3); if (!pml2) return 0;
+	
+	int count = 0;
+	
+	PageEntry& pde = pml2->m_entries[index_PML2];
+	if (!pml2->IsHugePage(index_PML2) && IsTableEmpty(pde))
+	{
+		pTables[count++] = pde.m_address << 12;
+		SetEntry(pde, 0);
+	}
+	
+	PageEntry& pdpte = pml3->m_entries[index_PML3];
+	if (!IsTableEmpty(pdpte))
+		return count;
+	
+	pTables[count++] = pdpte.m_address << 12;
+	SetEntry(pdpte, 0);
+	
+	// The PML3s of the kernel half are shared with every other page mapping, so they have to stay.
+	PageEntry& pml4e = m_entries[index_PML4];
+	if (index_PML4 >= P_KERN_START || !IsTableEmpty(pml4e))
+		return count;
+	
+	pTables[count++] = pml4e.m_address << 12;
+	pml4e.m_data = 0;
+	
+	return count;
 }
 
 /**** Unmap pages ****/
@@ -55,42 +184,71 @@ void PageMapping::UnmapPage(uintptr_t addr, bool removeUpperLevels)
 	
 	PML3          *pml3 =       GetPML3         (index_PML4); if (!pml3) return;
 	PageDirectory *pml2 = pml3->GetPageDirectory(index_PML3); if (!pml2) return;
+	
+	// If this page is part of a huge page, split it up, so that only this page is unmapped.
+	if (pml2->IsHugePage(index_PML2) && !SplitHugePage(addr))
+	{
+		SLogMsg("Could not split up huge page at %p to unmap a page", addr);
+		return;
+	}
+	
 	PageTable     *pml1 = pml2->GetPageTable    (index_PML2); if (!pml1) return;
 	
 	PageEntry& ent = pml1->m_entries[index_PML1];
 	
-	// If this was a part of the PMM, free the page.
-	if (ent.m_partOfPmm)
-	{
-		PMM::FreePage(ent.m_address << 12);
-	}
+	bool bWasPresent = ent.m_present;
+	bool bFreePage   = ent.m_partOfPmm && ent.m_present;
+	uintptr_t page   = ent.m_address << 12;
 	
-	memset(&ent, 0, sizeof ent);
+	ForgetCompressedPage(ent);
+	SetEntry(ent, 0);
 	
+	// Thanks to the entry counts, we know if the levels above are empty without looking through them.
+	uintptr_t tables[3];
+	int tableCount = 0;
 	if (removeUpperLevels)
-	{
-		// TODO: Remove upper levels too if they're empty.
-	}
+		tableCount = DetachEmptyLevels(addr, tables);
+	
+	// The CPU may have cached walks through the detached tables too.
+	if (bWasPresent || tableCount)
+		FlushTLB(addr);
+	
+	// If this was a part of the PMM, free the page. This is only done now that no CPU can access it anymore.
+	if (bFreePage)
+		PMM::FreePage(page);
+	
+	for (int i = 0; i < tableCount; i++)
+		FreePageTable(tables[i]);
 }
 
 /**** Map pages ****/
-bool PageMapping::MapPage(uintptr_t addr, const PageEntry & pe)
+
+PageDirectory* PageMapping::GetPageDirectory(uintptr_t addr)
+{
+	constexpr uintptr_t mask = 0x1FF;
+	uintptr_t index_PML4 = (addr >> 39) & mask;
+	uintptr_t index_PML3 = (addr >> 30) & mask;
+	
+	PML3* pml3 = GetPML3(index_PML4);
+	if (!pml3) return NULL;
+	
+	return pml3->GetPageDirectory(index_PML3);
+}
+
+PageDirectory* PageMapping::GetOrAllocPageDirectory(uintptr_t addr)
 {
 	constexpr uintptr_t mask = 0x1FF;
 	uintptr_t index_PML4 = (addr >> 39) & mask;
 	uintptr_t index_PML3 = (addr >> 30) & mask;
-	uintptr_t index_PML2 = (addr >> 21) & mask;
-	uintptr_t index_PML1 = (addr >> 12) & mask;
 	
 	// if we don't have a pml3 here:
 	PML3* pml3 = GetPML3(index_PML4);
 	if (!pml3)
 	{
 		// allocate one
-		uintptr_t page = PMM::AllocatePage();
-		if (page == PMM::INVALID_PAGE) return false;
+		uintptr_t page = AllocatePageTable();
+		if (page == PMM::INVALID_PAGE) return NULL;
 		pml3 = (PML3*)(Arch::GetHHDMOffset() + page);
-		memset(pml3, 0, sizeof *pml3);
 		m_entries[index_PML4] = PageEntry(page, PE_PRESENT | PE_READWRITE | PE_PARTOFPMM);
 	}
 	
@@ -99,46 +257,51 @@ bool PageMapping::MapPage(uintptr_t addr, const PageEntry & pe)
 	if (!pd)
 	{
 		// allocate one
-		uintptr_t page = PMM::AllocatePage();
-		if (page == PMM::INVALID_PAGE) return false;
-		pd = (PageDirectory*)(Arch::GetHHDMOffset() + page);
-		memset(pd, 0, sizeof *pd);
-		pml3->m_entries[index_PML3] = PageEntry(page, PE_PRESENT | PE_READWRITE | PE_PARTOFPMM);
+		uintptr_t page = AllocatePageTable();
+		if (page == PMM::INVALID_PAGE) return NULL;
+		
+		if (!InstallTable(pml3->m_entries[index_PML3], page))
+			FreePageTable(page);
+		
+		pd = pml3->GetPageDirectory(index_PML3);
 	}
 	
+	return pd;
+}
+
+PageTable* PageDirectory::GetOrAllocPageTable(int index)
+{
+	if (IsHugePage(index)) return NULL;
+	
 	// if we don't have a pml1 here:
-	PageTable* pt = pd->GetPageTable(index_PML2);
+	PageTable* pt = GetPageTable(index);
 	if (!pt)
 	{
 		// allocate one
-		uintptr_t page = PMM::AllocatePage();
-		if (page == PMM::INVALID_PAGE) return false;
-		pt = (PageTable*)(Arch::GetHHDMOffset() + page);
-		memset(pt, 0, sizeof *pt);
-		pd->m_entries[index_PML2] = PageEntry(page, PE_PRESENT | PE_READWRITE | PE_PARTOFPMM);
+		uintptr_t page = AllocatePageTable();
+		if (page == PMM::INVALID_PAGE) return NULL;
+		
+		if (!InstallTable(m_entries[index], page))
+			FreePageTable(page);
+		
+		pt = GetPageTable(index);
 	}
 	
-	// unmap whatever was here previously.
-	UnmapPage(addr, false);
-	
-	// map the page in.
-	PageEntry& entry = pt->m_entries[index_PML1];
-	
-	entry = pe;
-	
-	return true;
+	return pt;
+}
+
+bool PageMapping::MapPage(uintptr_t addr, const PageEntry & pe)
+{
+	return MapRange(addr, 1, pe);
 }
 
 bool PageMapping::MapPage(uintptr_t addr, bool rw, bool super, bool xd)
 {
-	/*
-	uintptr_t pm = PMM::AllocatePage();
-	if (pm == PMM::INVALID_PAGE) return false;
-	
-	// Create a page entry. TODO don't actually allocate from the PMM but instead fault the page in.
-	PageEntry pe(pm, rw, super, xd, true, false);
-	*/
-	
+	return MapDemandPages(addr, 1, rw, super, xd);
+}
+
+bool PageMapping::MapDemandPages(uintptr_t addr, size_t pageCount, bool rw, bool super, bool xd, int faultAround)
+{
 	uint64_t flags = PE_PARTOFPMM | PE_NEEDALLOCPAGE;
 	if (rw)
 		flags |= PE_READWRITE;
@@ -147,13 +310,19 @@ bool PageMapping::MapPage(uintptr_t addr, bool rw, bool super, bool xd)
 	if (xd)
 		flags |= PE_EXECUTEDISABLE;
 	
+	if (faultAround < 0)
+		faultAround = 0;
+	if (faultAround > C_MAX_FAULT_AROUND)
+		faultAround = C_MAX_FAULT_AROUND;
+	
 	// Create a page entry. Note that the default_flags are overridden here.
 	PageEntry pe(0, flags, 0);
+	pe.m_faultAround = faultAround;
 	
-	return MapPage(addr, pe);
+	return MapRange(addr, pageCount, pe);
 }
 
-PageEntry* PageMapping::GetPageEntry(uintptr_t addr)
+PageEntry* PageMapping::GetPageEntry(uintptr_t addr, bool* pbHuge)
 {
 	// Remove a page mapping.
 	constexpr uintptr_t mask = 0x1FF;
@@ -166,12 +335,198 @@ PageEntry* PageMapping::GetPageEntry(uintptr_t addr)
 	PageDirectory *pPageDir; 
 	PageTable     *pPageTable; 
 	
+	if (pbHuge)
+		*pbHuge = false;
+	
 	if (!(pPml3      = GetPML3                   (index_PML4))) return NULL;
 	if (!(pPageDir   = pPml3   ->GetPageDirectory(index_PML3))) return NULL;
+	
+	if (pPageDir->IsHugePage(index_PML2))
+	{
+		if (pbHuge)
+			*pbHuge = true;
+		
+		return &pPageDir->m_entries[index_PML2];
+	}
+	
 	if (!(pPageTable = pPageDir->GetPageTable    (index_PML2))) return NULL;
 	return pPageTable->GetPageEntry(index_PML1);
 }
 
+/**** Huge pages ****/
+
+bool PageMapping::MapHugePage(uintptr_t addr, const PageEntry & pe)
+{
+	if (addr & (HUGE_PAGE_SIZE - 1))
+		return false;
+	
+	uintptr_t index_PML2 = (addr >> 21) & 0x1FF;
+	
+	PageDirectory* pd = GetOrAllocPageDirectory(addr);
+	if (!pd) return false;
+	
+	// unmap whatever was here previously.
+	UnmapHugePage(addr);
+	
+	SetEntry(pd->m_entries[index_PML2], pe.m_data | PE_PAGESIZE);
+	
+	return true;
+}
+
+bool PageMapping::MapHugePage(uintptr_t addr, bool rw, bool super, bool xd)
+{
+	if (addr & (HUGE_PAGE_SIZE - 1))
+		return false;
+	
+	uintptr_t block = PMM::AllocatePages(HUGE_PAGE_ORDER);
+	if (block == PMM::INVALID_PAGE)
+		return false;
+	
+	memset((void*)(Arch::GetHHDMOffset() + block), 0, HUGE_PAGE_SIZE);
+	
+	uint64_t flags = PE_PAGESIZE | PE_PARTOFPMM;
+	if (rw)
+		flags |= PE_READWRITE;
+	if (super)
+		flags |= PE_SUPERVISOR;
+	if (xd)
+		flags |= PE_EXECUTEDISABLE;
+	
+	PageEntry pe(block, flags);
+	
+	if (!MapHugePage(addr, pe))
+	{
+		PMM::FreePages(block, HUGE_PAGE_ORDER);
+		return false;
+	}
+	
+	return true;
+}
+
+void PageMapping::UnmapHugePage(uintptr_t addr)
+{
+	constexpr uintptr_t mask = 0x1FF;
+	uintptr_t index_PML4 = (addr >> 39) & mask;
+	uintptr_t index_PML3 = (addr >> 30) & mask;
+	uintptr_t index_PML2 = (addr >> 21) & mask;
+	
+	addr &= ~(HUGE_PAGE_SIZE - 1);
+	
+	PML3          *pml3 =       GetPML3         (index_PML4); if (!pml3) return;
+	PageDirectory *pml2 = pml3->GetPageDirectory(index_PML3); if (!pml2) return;
+	
+	PageEntry& ent = pml2->m_entries[index_PML2];
+	if (!ent.m_present)
+	{
+		SetEntry(ent, 0);
+		return;
+	}
+	
+	bool bFreeBlock = ent.m_partOfPmm;
+	uintptr_t block = ent.m_address << 12;
+	
+	if (pml2->IsHugePage(index_PML2))
+	{
+		SetEntry(ent, 0);
+		FlushTLB(addr);
+		
+		// If this was a part of the PMM, free the block.
+		if (bFreeBlock)
+			PMM::FreePages(block, HUGE_PAGE_ORDER);
+		
+		return;
+	}
+	
+	// It's a page table. Detach it, flush its pages from every TLB, then free them along with the table.
+	PageTable* pml1 = pml2->GetPageTable(index_PML2);
+	
+	SetEntry(ent, 0);
+	FlushTLB(addr, HUGE_PAGE_SIZE / PAGE_SIZE);
+	
+	for (int i = 0; i < 512; i++)
+	{
+		PageEntry& pte = pml1->m_entries[i];
+		if (pte.m_present && pte.m_partOfPmm)
+			PMM::FreePage(pte.m_address << 12);
+		
+		ForgetCompressedPage(pte);
+	}
+	
+	if (bFreeBlock)
+		FreePageTable(block);
+}
+
+bool PageMapping::SplitHugePage(uintptr_t addr)
+{
+	constexpr uintptr_t mask = 0x1FF;
+	uintptr_t index_PML4 = (addr >> 39) & mask;
+	uintptr_t index_PML3 = (addr >> 30) & mask;
+	uintptr_t index_PML2 = (addr >> 21) & mask;
+	
+	addr &= ~(HUGE_PAGE_SIZE - 1);
+	
+	PML3          *pml3 =       GetPML3         (index_PML4); if (!pml3) return false;
+	PageDirectory *pml2 = pml3->GetPageDirectory(index_PML3); if (!pml2) return false;
+	
+	if (!pml2->IsHugePage(index_PML2))
+		return false;
+	
+	uintptr_t page = PMM::AllocatePage();
+	if (page == PMM::INVALID_PAGE)
+		return false;
+	
+	TrackPageTable(page);
+	
+	PageTable* pml1 = (PageTable*)(Arch::GetHHDMOffset() + page);
+	PageEntry& ent  = pml2->m_entries[index_PML2];
+	
+	// If the block is shared with another page mapping, we can't split it up under its feet, so take a copy of it first.
+	PMM::PageFrame* pFrame = ent.m_partOfPmm ? PMM::GetPageFrame(ent.m_address << 12) : NULL;
+	if (pFrame && pFrame->m_refCount.Load() > 1)
+	{
+		uintptr_t newBlock = PMM::AllocatePages(HUGE_PAGE_ORDER);
+		if (newBlock == PMM::INVALID_PAGE)
+		{
+			FreePageTable(page);
+			return false;
+		}
+		
+		memcpy((void*)(Arch::GetHHDMOffset() + newBlock), (void*)(Arch::GetHHDMOffset() + (ent.m_address << 12)), HUGE_PAGE_SIZE);
+		PMM::FreePages(ent.m_address << 12, HUGE_PAGE_ORDER);
+		
+		ent.m_address = newBlock >> 12;
+		
+		// It's ours alone now.
+		if (ent.m_copyOnWrite)
+		{
+			ent.m_copyOnWrite = false;
+			ent.m_readWrite   = true;
+		}
+	}
+	
+	// The PAT bit of a huge page is bit 12, and that of a normal page is bit 7.
+	uintptr_t base  = (ent.m_address << 12) & ~(HUGE_PAGE_SIZE - 1);
+	uint64_t  flags = ent.m_data & ~(C_PAGE_ADDRESS_MASK | PE_PAGESIZE);
+	if (ent.m_data & PE_PAT_HUGE)
+		flags |= PE_PAT;
+	
+	for (int i = 0; i < 512; i++)
+		pml1->m_entries[i].m_data = flags | (base + i * PAGE_SIZE);
+	
+	PMM::PageFrame* pTableFrame = PMM::GetPageFrame(page);
+	if (pTableFrame)
+		pTableFrame->m_usedEntries = 512;
+	
+	// The block's pages will be freed one by one from now on.
+	if (ent.m_partOfPmm)
+		PMM::SplitBlock(base, HUGE_PAGE_ORDER);
+	
+	ent = PageEntry(page, PE_PRESENT | PE_READWRITE | PE_PARTOFPMM);
+	FlushTLB(addr);
+	
+	return true;
+}
+
 /**** Switch To ****/
 
 void PageMapping::SwitchTo()
@@ -183,7 +538,39 @@ void PageMapping::SwitchTo()
 	}
 	
 	// Go!!
-	Arch::WriteCR3((uintptr_t)this - Arch::GetHHDMOffset());
+	Arch::TLB::LoadAddressSpace((uintptr_t)this - Arch::GetHHDMOffset(), GetGeneration());
+}
+
+/**** TLB ****/
+
+static Atomic<uint64_t> s_nextGeneration { 1 };
+
+uint64_t PageMapping::GetGeneration()
+{
+	// The mapping the bootloader gave us isn't part of the PMM, so it's stuck at generation zero.
+	PMM::PageFrame* pFrame = PMM::GetPageFrame((uintptr_t)this - Arch::GetHHDMOffset());
+	if (!pFrame)
+		return 0;
+	
+	return pFrame->m_pageMapGen;
+}
+
+void PageMapping::BumpGeneration()
+{
+	PMM::PageFrame* pFrame = PMM::GetPageFrame((uintptr_t)this - Arch::GetHHDMOffset());
+	if (!pFrame)
+		return;
+	
+	pFrame->m_pageMapGen = s_nextGeneration.FetchAdd(1);
+}
+
+void PageMapping::FlushTLB(uintptr_t addr, size_t pageCount)
+{
+	// The kernel half is shared by all page mappings, while the lower half is only cached under our own PCID.
+	if (((addr >> 39) & 0x1FF) >= P_KERN_START || this == GetFromCR3())
+		Arch::TLB::Shootdown(addr, pageCount);
+	else
+		BumpGeneration();
 }
 
 }; // namespace VMM
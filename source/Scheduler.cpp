@@ -12,11 +12,26 @@
 
 static Atomic<int> g_NextThreadID(1);
 
+static KObjectPool<Thread> s_ThreadPool;
+
 void Scheduler::IdleThread()
 {
+	uintptr_t compressCursor = 0;
+	
+	Scheduler* pSched = Arch::CPU::GetCurrent()->GetScheduler();
+	
 	while (true)
 	{
-		Arch::Halt();
+		// Dispose of the threads that died since the last time we got to run.
+		pSched->CheckZombieThreads();
+		
+		// Use the spare time to zero out some free pages.
+		if (PMM::ZeroFreePages(C_IDLE_ZERO_BATCH))
+			continue;
+		
+		// Then, look for pages that can be compressed. Only halt once a whole pass is over.
+		if (!VMM::PageMapping::GetFromCR3()->CompressPages(compressCursor, C_IDLE_COMPRESS_BATCH))
+			Arch::Halt();
 	}
 }
 
@@ -25,10 +40,25 @@ void Scheduler::NormalThread()
 	int x=0;
 	volatile int* px = &x;
 	
+	int iteration = 0;
+	
 	while (true)
 	{
 		LogMsg("Normal thread on CPU %u", Arch::CPU::GetCurrent()->ID());
 		
+		// Every so often, start a thread that exits right away, so that zombie threads get reaped.
+		// It's detached before it's started, so that it can't die while it's still owned by us.
+		if (++iteration % 10 == 0)
+		{
+			Thread* pThrd = Arch::CPU::GetCurrent()->GetScheduler()->CreateThread();
+			if (pThrd)
+			{
+				pThrd->SetEntryPoint(Scheduler::ShortLivedThread);
+				pThrd->Detach();
+				pThrd->Start();
+			}
+		}
+		
 		Thread::Sleep(100'000'000); // sleep for 100 MS
 	}
 }
@@ -46,15 +76,28 @@ void Scheduler::RealTimeThread()
 	}
 }
 
+void Scheduler::ShortLivedThread()
+{
+	LogMsg("Short lived thread %d on CPU %u", Thread::GetCurrent()->m_ID, Arch::CPU::GetCurrent()->ID());
+}
+
 Thread* Scheduler::CreateThread()
 {
-	Thread* pThrd = new(nopanic) Thread;
+	Thread* pThrd = s_ThreadPool.New();
+	if (!pThrd)
+		return nullptr;
 	
 	pThrd->m_pScheduler = this;
 	pThrd->m_ID  = g_NextThreadID.FetchAdd(1);
 	
+	// The idle thread may be deleting a thread from the list at the same time.
+	auto pCpu = Arch::CPU::GetCurrent();
+	bool bOldState = pCpu->SetInterruptsEnabled(false);
+	
 	m_AllThreads.AddBack(pThrd);
 	
+	pCpu->SetInterruptsEnabled(bOldState);
+	
 	return pThrd;
 }
 
@@ -148,7 +191,28 @@ void Scheduler::CheckUnsuspensionConditions()
 // looks through the list of zombie threads and kills them.
 void Scheduler::CheckZombieThreads()
 {
-	// TODO
+	auto pCpu = Arch::CPU::GetCurrent();
+	
+	while (true)
+	{
+		// The list is filled in by Done, with interrupts disabled.
+		bool bOldState = pCpu->SetInterruptsEnabled(false);
+		
+		Thread* pThread = nullptr;
+		if (!m_ZombieThreads.Empty())
+		{
+			pThread = m_ZombieThreads.Front();
+			m_ZombieThreads.PopFront();
+		}
+		
+		pCpu->SetInterruptsEnabled(bOldState);
+		
+		if (!pThread)
+			break;
+		
+		// A zombie is only put on the list once it was switched away from, so nothing runs on its stack anymore.
+		DeleteThread(pThread);
+	}
 }
 
 // looks through the list of sleeping threads and unsuspends them if needed
@@ -235,22 +299,35 @@ void Scheduler::Schedule(bool bRunFromTimerIRQ)
 	m_pCurrentThread->JumpExecContext();
 }
 
+// Note: This may not be run on the thread being deleted, or from an interrupt handler.
 void Scheduler::DeleteThread(Thread* pThread)
 {
+	auto pCpu = Arch::CPU::GetCurrent();
+	bool bOldState = pCpu->SetInterruptsEnabled(false);
+	
+	bool bFound = false;
 	for (auto it = m_AllThreads.Begin(); it.Valid(); ++it)
 	{
 		if (*it != pThread) continue;
 		
 		m_AllThreads.Erase(it);
-		
-		return;
+		bFound = true;
+		break;
 	}
+	
+	pCpu->SetInterruptsEnabled(bOldState);
+	
+	if (!bFound)
+		return;
+	
+	// The stack isn't a part of the thread object, so it has to be given back separately.
+	VMM::FreeVirtual(pThread->m_pStack);
+	s_ThreadPool.Delete(pThread);
 }
 
 void Scheduler::CheckEvents()
 {
 	CheckUnsuspensionConditions();
-	CheckZombieThreads();
 	UnsuspendSleepingThreads();
 }
 
@@ -31,9 +31,30 @@ void RunAllDestructors()
 		(*func)();
 }
 
-static void* OperatorNew(size_t size)
+// Small blocks come from the slabs, and the rest from the kernel heap. The call site is the code
+// that used new, so that the kernel heap's profiler can tell who's allocating.
+static void* AllocateBlock(size_t size, void* pCallSite)
+{
+	if (size <= VMM::SlabAllocator::C_MAX_SIZE)
+	{
+		void* pMem = VMM::SlabAllocator::Allocate(size);
+		if (pMem)
+			return pMem;
+	}
+	
+	return VMM::KernelHeap::Allocate(size, pCallSite);
+}
+
+// The slabs' objects start right after the slab's header, so they're only guaranteed to be 16 byte aligned.
+// Over-aligned blocks always come from the kernel heap.
+static void* AllocateAlignedBlock(size_t size, std::align_val_t align, void* pCallSite)
+{
+	return VMM::KernelHeap::AllocateAligned(size, size_t(align), pCallSite);
+}
+
+static void* OperatorNew(size_t size, void* pCallSite)
 {
-	void* pMem = VMM::KernelHeap::Allocate(size);
+	void* pMem = AllocateBlock(size, pCallSite);
 	
 	if (!pMem)
 		KernelPanic("ERROR: cannot new[](%z), kernel heap gave us NULL.", size);
@@ -41,29 +62,63 @@ static void* OperatorNew(size_t size)
 	return pMem;
 }
 
+static void* OperatorNewAligned(size_t size, std::align_val_t align, void* pCallSite)
+{
+	void* pMem = AllocateAlignedBlock(size, align, pCallSite);
+	
+	if (!pMem)
+		KernelPanic("ERROR: cannot new[](%z, align %z), kernel heap gave us NULL.", size, size_t(align));
+	
+	return pMem;
+}
+
 static void OperatorFree(void* ptr)
 {
-	VMM::KernelHeap::Free(ptr);
+	if (!ptr)
+		return;
+	
+	if (!VMM::SlabAllocator::Free(ptr))
+		VMM::KernelHeap::Free(ptr);
 }
 
 void* operator new(size_t size)
 {
-	return OperatorNew(size);
+	return OperatorNew(size, __builtin_return_address(0));
 }
 
 void* operator new[](size_t size)
 {
-	return OperatorNew(size);
+	return OperatorNew(size, __builtin_return_address(0));
 }
 
 void* operator new(size_t size, const nopanic_t&)
 {
-	return VMM::KernelHeap::Allocate(size);
+	return AllocateBlock(size, __builtin_return_address(0));
 }
 
 void* operator new[](size_t size, const nopanic_t&)
 {
-	return VMM::KernelHeap::Allocate(size);
+	return AllocateBlock(size, __builtin_return_address(0));
+}
+
+void* operator new(size_t size, std::align_val_t align)
+{
+	return OperatorNewAligned(size, align, __builtin_return_address(0));
+}
+
+void* operator new[](size_t size, std::align_val_t align)
+{
+	return OperatorNewAligned(size, align, __builtin_return_address(0));
+}
+
+void* operator new(size_t size, std::align_val_t align, const nopanic_t&)
+{
+	return AllocateAlignedBlock(size, align, __builtin_return_address(0));
+}
+
+void* operator new[](size_t size, std::align_val_t align, const nopanic_t&)
+{
+	return AllocateAlignedBlock(size, align, __builtin_return_address(0));
 }
 
 void operator delete(void* ptr)
@@ -86,6 +141,26 @@ void operator delete[](void* ptr, UNUSED size_t size)
 	OperatorFree(ptr);
 }
 
+void operator delete(void* ptr, UNUSED std::align_val_t align)
+{
+	OperatorFree(ptr);
+}
+
+void operator delete[](void* ptr, UNUSED std::align_val_t align)
+{
+	OperatorFree(ptr);
+}
+
+void operator delete(void* ptr, UNUSED size_t size, UNUSED std::align_val_t align)
+{
+	OperatorFree(ptr);
+}
+
+void operator delete[](void* ptr, UNUSED size_t size, UNUSED std::align_val_t align)
+{
+	OperatorFree(ptr);
+}
+
 // cxa calls
 extern "C"
 {
@@ -61,6 +61,24 @@ void Terminal::Setup()
 Spinlock g_E9Spinlock;
 Spinlock g_TermSpinlock;
 
+void Terminal::RemapFramebuffer()
+{
+	limine_framebuffer* pFB = g_FramebufferRequest.response->framebuffers[0];
+	
+	// Limine's mapping of the framebuffer is part of the HHDM.
+	uintptr_t phys = uintptr_t(pFB->address) - Arch::GetHHDMOffset();
+	
+	void* pMem = VMM::MapMMIO(phys, pFB->pitch * pFB->height, VMM::MT_WRITECOMBINE);
+	if (!pMem)
+	{
+		SLogMsg("Could not map the framebuffer as write combining");
+		return;
+	}
+	
+	LockGuard lg(g_TermSpinlock);
+	((fbterm_context*)g_pTermContext)->framebuffer = (volatile uint32_t*)pMem;
+}
+
 void Terminal::E9Write(const char* str)
 {
 	//LockGuard lg(g_E9Spinlock);
@@ -106,21 +106,22 @@ void Thread::Resume()
 void Thread::Start()
 {
 	using namespace Arch;
-	auto pCpu = CPU::GetCurrent();
 	
 	// This function starts the thread.
 	
-	// Clear interrupts. This prevents the scheduler from running during its manipulation:
-	bool bOldState = pCpu->SetInterruptsEnabled(false);
-	
-	// Set up the stack.
+	// Set up the stack. Its pages are only allocated once they are touched, and the page below it
+	// is never mapped, so overflowing it faults instead of corrupting something else. This is done
+	// before interrupts are cleared, since allocating it may have to wait for the other CPUs.
 	size_t nStackSizeLongs = m_StackSize / 8;
 	
-	m_pStack = new uint64_t[nStackSizeLongs];
+	m_pStack = (uint64_t*)VMM::AllocateVirtual(m_StackSize, true);
+	if (!m_pStack)
+		KernelPanic("Could not allocate a %z byte stack for thread %d", m_StackSize, m_ID);
 	
-	// Ensure the stack won't fault on access by faulting it in ourselves
-	for (size_t i = 0; i < nStackSizeLongs; i++)
-		m_pStack[i] = 0;
+	auto pCpu = CPU::GetCurrent();
+	
+	// Clear interrupts. This prevents the scheduler from running during its manipulation:
+	bool bOldState = pCpu->SetInterruptsEnabled(false);
 	
 	// Preparing the execution context:
 	
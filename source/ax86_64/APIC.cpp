@@ -71,16 +71,19 @@ enum
 	APIC_ICR1_BROADCAST_OTHERS = (3 << 18),
 };
 
+// The LAPIC's registers, mapped as uncached. Until they're mapped, the HHDM is used.
+static uintptr_t s_lapicBase;
+
 // Write a register.
 void APIC::WriteReg(uint32_t reg, uint32_t value)
 {
-	WritePhys(GetLapicBasePhys() + reg, value);
+	*(volatile uint32_t*)(GetLapicBase() + reg) = value;
 }
 
 // Read a register.
 uint32_t APIC::ReadReg(uint32_t reg)
 {
-	return ReadPhys(GetLapicBasePhys() + reg);
+	return *(volatile uint32_t*)(GetLapicBase() + reg);
 }
 
 uintptr_t APIC::GetLapicBasePhys()
@@ -95,6 +98,9 @@ uintptr_t APIC::GetLapicBasePhys()
 
 uintptr_t APIC::GetLapicBase()
 {
+	if (s_lapicBase)
+		return s_lapicBase;
+	
 	return GetHHDMOffset() + GetLapicBasePhys();
 }
 
@@ -140,6 +146,26 @@ extern "C" void Arch_APIC_OnIPInterrupt()
 	pCpu->UnlockIpiSpinlock();
 }
 
+extern "C" void Arch_APIC_OnDrainInterrupt_Asm();
+extern "C" void Arch_APIC_OnDrainInterrupt(Registers* pRegs)
+{
+	using namespace Arch;
+	
+	// Get the current CPU.
+	CPU* pCpu = CPU::GetCurrent();
+	
+	// make sure to let ourselves know that right now, interrupts are disabled.
+	pCpu->InterruptsEnabledRaw() = false;
+	
+	PMM::ProcessDrainRequest();
+	
+	// Send an EOI.
+	APIC::EndOfInterrupt();
+	
+	// go back to the old state
+	pCpu->InterruptsEnabledRaw() = (pRegs->rflags & C_RFLAGS_INTERRUPT_FLAG);
+}
+
 extern "C" void Arch_APIC_OnTimerInterrupt_Asm();
 extern "C" void Arch_APIC_OnTimerInterrupt(Registers* pRegs)
 {
@@ -183,6 +209,10 @@ void APIC::Init()
 		// Mask all interrupts.
 		WriteByte(picDataPrim, 0xFF);
 		WriteByte(picDataSecd, 0xFF);
+		
+		// Map the LAPIC's registers as strongly uncached, instead of relying on the caching the HHDM has.
+		// Every CPU's LAPIC sits at the same address, so one mapping does for all of them.
+		s_lapicBase = uintptr_t(VMM::MapMMIO(GetLapicBasePhys(), PAGE_SIZE, VMM::MT_UNCACHED));
 	}
 	
 	// Set this CPU's IDT entry.
@@ -192,28 +222,40 @@ void APIC::Init()
 	WriteReg(APIC_REG_SPURIOUS, IDT::INT_SPURIOUS | 0x100);
 }
 
+void APIC::SendIPI(uint32_t lapicID, uint8_t vector)
+{
+	// Wait for any pending IPIs to finish on this CPU.
+	while (ReadReg(APIC_REG_ICR0) & APIC_ICR0_DELIVERY_STATUS) Spinlock::SpinHint();
+	
+	// Write the destination CPU's LAPIC ID.
+	WriteReg(APIC_REG_ICR1, lapicID << 24);
+	
+	// Write the interrupt vector. This sends the IPI.
+	WriteReg(APIC_REG_ICR0, vector | APIC_ICR1_SINGLE);
+}
+
 void CPU::SendIPI(eIpiType type)
 {
 	// The destination is 'this'. The sender (us) is 'pSenderCPU'.
 	CPU * pSenderCPU = GetCurrent();
 	
-	// Wait for any pending IPIs to finish on this CPU.
-	while (APIC::ReadReg(APIC_REG_ICR0) & APIC_ICR0_DELIVERY_STATUS) Spinlock::SpinHint();
-	
 	m_ipiSpinlock.Lock();
 	
 	m_ipiType = type;
 	m_ipiSenderID = pSenderCPU->m_processorID;
 	
-	// Write the destination CPU's LAPIC ID.
-	APIC::WriteReg(APIC_REG_ICR1, m_pSMPInfo->lapic_id << 24);
-	
-	// Write the interrupt vector.
-	APIC::WriteReg(APIC_REG_ICR0, IDT::INT_IPI | APIC_ICR1_SINGLE);
+	bool bInts = pSenderCPU->SetInterruptsEnabled(false);
+	APIC::SendIPI(m_pSMPInfo->lapic_id, IDT::INT_IPI);
+	pSenderCPU->SetInterruptsEnabled(bInts);
 	
 	// The CPU in question will unlock the IPI spinlock.
 }
 
+void CPU::SendDrainIPI()
+{
+	APIC::SendIPI(m_pSMPInfo->lapic_id, IDT::INT_CACHE_DRAIN);
+}
+
 PolledSleepFunc g_PolledSleepFunc = PIT::PolledSleep;
 
 void APIC::SetPolledSleepFunc(PolledSleepFunc func)
@@ -78,6 +78,18 @@ void WriteByte(uint16_t port, uint8_t data)
 	ASM("outb %0, %1"::"a"((uint8_t)data),"Nd"((uint16_t)port));
 }
 
+uintptr_t ReadCR0()
+{
+	uintptr_t cr0 = 0;
+	ASM("movq %%cr0, %0":"=r"(cr0));
+	return cr0;
+}
+
+void WriteCR0(uintptr_t cr0)
+{
+	ASM("movq %0, %%cr0"::"r"(cr0):"memory");
+}
+
 uintptr_t ReadCR3()
 {
 	uintptr_t cr3 = 0;
@@ -90,6 +102,18 @@ void WriteCR3(uintptr_t cr3)
 	ASM("movq %0, %%cr3"::"r"(cr3));
 }
 
+uintptr_t ReadCR4()
+{
+	uintptr_t cr4 = 0;
+	ASM("movq %%cr4, %0":"=r"(cr4));
+	return cr4;
+}
+
+void WriteCR4(uintptr_t cr4)
+{
+	ASM("movq %0, %%cr4"::"r"(cr4):"memory");
+}
+
 void WriteMSR(uint32_t msr, uint64_t value)
 {
 	uint32_t edx = uint32_t(value >> 32);
@@ -107,6 +131,40 @@ uint64_t ReadMSR(uint32_t msr)
 	return uint64_t(edx) << 32 | eax;
 }
 
+void InitPAT()
+{
+	enum
+	{
+		PAT_UC  = 0x00,
+		PAT_WC  = 0x01,
+		PAT_WT  = 0x04,
+		PAT_WB  = 0x06,
+		PAT_UCM = 0x07, // UC-
+	};
+	
+	// Entries 0 to 3 keep their power-on values, so existing mappings don't change type. Entry 4 becomes write
+	// combining.
+	uint64_t pat = 0;
+	const uint8_t types[8] = { PAT_WB, PAT_WT, PAT_UCM, PAT_UC, PAT_WC, PAT_WT, PAT_UCM, PAT_UC };
+	
+	for (int i = 0; i < 8; i++)
+		pat |= uint64_t(types[i]) << (i * 8);
+	
+	// The bootloader may have programmed the PAT differently, so follow the SDM's sequence for changing it:
+	// stop caching, write back the caches and flush the TLB, program it, then do that again before caching
+	// is turned back on. This runs before interrupts are enabled on this CPU.
+	uintptr_t cr0 = ReadCR0();
+	WriteCR0((cr0 | C_CR0_CD) & ~C_CR0_NW);
+	ASM("wbinvd":::"memory");
+	TLB::FlushAll();
+	
+	WriteMSR(eMSR::IA32_PAT, pat);
+	
+	ASM("wbinvd":::"memory");
+	TLB::FlushAll();
+	WriteCR0(cr0);
+}
+
 // Since the pointer to the structure is passed into RDI, assuming
 // the x86_64 System V ABI, the first argument corresponds to RDI.
 void CPU::Start(limine_smp_info* pInfo)
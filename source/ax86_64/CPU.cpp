@@ -23,9 +23,21 @@ Spinlock g_CalibrateSpinlock;
 extern "C" void CPU_OnPageFault_Asm();
 extern "C" void Arch_APIC_OnIPInterrupt_Asm();
 extern "C" void Arch_APIC_OnTimerInterrupt_Asm();
+extern "C" void Arch_TLB_OnShootdownInterrupt_Asm();
+extern "C" void Arch_APIC_OnDrainInterrupt_Asm();
 extern "C" void CPU_OnPageFault(Registers* pRegs)
 {
-	Arch::CPU::GetCurrent()->OnPageFault(pRegs);
+	using namespace Arch;
+	
+	CPU* pCpu = CPU::GetCurrent();
+	
+	// The page fault handler allocates pages, so the per-CPU page cache must know that interrupts are now disabled.
+	pCpu->InterruptsEnabledRaw() = false;
+	
+	pCpu->OnPageFault(pRegs);
+	
+	// go back to the old state
+	pCpu->InterruptsEnabledRaw() = (pRegs->rflags & C_RFLAGS_INTERRUPT_FLAG);
 }
 
 void Arch::CPU::SetupGDTAndIDT()
@@ -34,9 +46,11 @@ void Arch::CPU::SetupGDTAndIDT()
 	LoadGDT();
 	
 	// Setup the IDT....
-	SetInterruptGate(IDT::INT_PAGE_FAULT, uintptr_t(CPU_OnPageFault_Asm));
-	SetInterruptGate(IDT::INT_IPI,        uintptr_t(Arch_APIC_OnIPInterrupt_Asm));
-	SetInterruptGate(IDT::INT_APIC_TIMER, uintptr_t(Arch_APIC_OnTimerInterrupt_Asm));
+	SetInterruptGate(IDT::INT_PAGE_FAULT,    uintptr_t(CPU_OnPageFault_Asm), C_PAGE_FAULT_IST);
+	SetInterruptGate(IDT::INT_IPI,           uintptr_t(Arch_APIC_OnIPInterrupt_Asm));
+	SetInterruptGate(IDT::INT_APIC_TIMER,    uintptr_t(Arch_APIC_OnTimerInterrupt_Asm));
+	SetInterruptGate(IDT::INT_TLB_SHOOTDOWN, uintptr_t(Arch_TLB_OnShootdownInterrupt_Asm));
+	SetInterruptGate(IDT::INT_CACHE_DRAIN,   uintptr_t(Arch_APIC_OnDrainInterrupt_Asm));
 	//SetInterruptGate(0, uintptr_t(Arch_APIC_OnTimerInterrupt_Asm));
 	
 	// Load the IDT.
@@ -97,25 +111,38 @@ void Arch::CPU::Init()
 		WaitForBSP();
 	}
 	
-	// Allocate a small stack
-	m_pIsrStack = EternalHeap::Allocate(C_INTERRUPT_STACK_SIZE);
-	
-	// Set it in the TSS
-	m_gdt.m_tss.m_rsp[0] = m_gdt.m_tss.m_rsp[1] = m_gdt.m_tss.m_rsp[2] = uint64_t(m_pIsrStack);
+	// Allocate a small stack, and one for the page fault handler
+	m_pIsrStack       = EternalHeap::Allocate(C_INTERRUPT_STACK_SIZE);
+	m_pPageFaultStack = EternalHeap::Allocate(C_INTERRUPT_STACK_SIZE);
 	
 	// Write the GS base MSR.
 	WriteMSR(Arch::eMSR::KERNEL_GS_BASE, uint64_t(this));
 	
 	SetupGDTAndIDT();
 	
+	// Set them in the TSS. This is done after loading the GDT, since that resets the TSS. Stacks grow down,
+	// so it's the end of each that goes in.
+	uint64_t isrStackTop = uint64_t(m_pIsrStack) + C_INTERRUPT_STACK_SIZE;
+	m_gdt.m_tss.m_rsp[0] = m_gdt.m_tss.m_rsp[1] = m_gdt.m_tss.m_rsp[2] = isrStackTop;
+	m_gdt.m_tss.m_ist[C_PAGE_FAULT_IST - 1] = uint64_t(m_pPageFaultStack) + C_INTERRUPT_STACK_SIZE;
+	
+	// Every CPU must agree on what each PAT entry means.
+	InitPAT();
+	
 	if (bIsBSP)
 	{
 		KernelHeap::Init();
+		InitVirtualRegion();
+		Terminal::RemapFramebuffer();
 	}
 	
 	// Clone the page mapping and assign it to this CPU. This will
 	// ditch the lower half mapping that the bootloader has provided us.
 	m_pPageMap = PageMapping::GetFromCR3()->Clone(false);
+	
+	// Tag the TLB entries of each page mapping with a PCID, so that they aren't flushed when switching between them.
+	TLB::InitPCID();
+	
 	m_pPageMap->SwitchTo();
 	
 	if (bIsBSP)
@@ -134,6 +161,10 @@ void Arch::CPU::Init()
 	
 	g_CPUsInitialized.FetchAdd(1);
 	
+	// Start receiving TLB shootdowns and page cache drain requests from other CPUs.
+	TLB::OnCPUOnline();
+	PMM::OnCPUOnline();
+	
 	// Enable interrupts.
 	SetInterruptsEnabled(true);
 	
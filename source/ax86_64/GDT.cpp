@@ -27,6 +27,9 @@ static UNUSED Arch::GDT g_InitialGDT =
 		0x00affb000000ffff, // 64-bit ring-3 code
 		0x00aff3000000ffff, // 64-bit ring-3 data
 	},
+	{
+		0, 0,                      // TSS descriptor, filled in by LoadGDT
+	},
 	{
 		0,                         // reserved0
 		{ 0, 0, 0 },               // RSP0-2
@@ -44,6 +47,13 @@ void Arch::CPU::LoadGDT()
 	// Setup the GDT.
 	m_gdt = g_InitialGDT;
 	
+	// Point the TSS descriptor to our own TSS. It's a present, available 64-bit TSS.
+	uint64_t tssBase  = uint64_t(&m_gdt.m_tss);
+	uint64_t tssLimit = sizeof(Arch::TSS) - 1;
+	
+	m_gdt.m_TssEntry[0] = (tssLimit & 0xFFFF) | (tssBase & 0xFFFFFF) << 16 | 0x89ULL << 40 | ((tssLimit >> 16) & 0xF) << 48 | ((tssBase >> 24) & 0xFF) << 56;
+	m_gdt.m_TssEntry[1] = tssBase >> 32;
+	
 	// Setup a descriptor.
 	struct
 	{
@@ -51,10 +61,13 @@ void Arch::CPU::LoadGDT()
 		uint64_t m_gdtBase;
 	} PACKED gdtr;
 	
-	gdtr.m_gdtLimit = sizeof(Arch::GDT) - 1;
+	gdtr.m_gdtLimit = offsetof(Arch::GDT, m_tss) - 1;
 	gdtr.m_gdtBase  = uint64_t(&m_gdt);
 	
 	// Note: For now we do not need to reload segments such as CS and DS.
 	// We will need to however, once we remove the 16- and 32-bit segments.
 	ASM("lgdt %0"::"m"(gdtr));
+	
+	// Load the task register, so that the CPU can find the interrupt stacks.
+	ASM("ltr %0"::"r"(uint16_t(Arch::GDT::DESC_TSS)));
 }
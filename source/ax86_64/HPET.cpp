@@ -136,11 +136,9 @@ void HPET::Found(RSD::Table* pTable)
 	using namespace VMM;
 	
 	// map it in.
-	PageMapping* pPM = PageMapping::GetFromCR3();
-	
-	pPM->MapPage(C_HPET_MAP_ADDRESS, PageEntry(g_HpetTable.m_Address.m_Address, PE_PRESENT | PE_READWRITE | PE_SUPERVISOR | PE_EXECUTEDISABLE | PE_CACHEDISABLE));
-	
-	g_pHpetRegisters = (HPETRegisters*)C_HPET_MAP_ADDRESS;
+	g_pHpetRegisters = (HPETRegisters*)MapMMIO(g_HpetTable.m_Address.m_Address, sizeof(HPETRegisters), MT_UNCACHED);
+	if (!g_pHpetRegisters)
+		KernelPanic("Could not map the HPET's registers");
 	
 	g_HpetGeneralCaps.m_Contents = g_pHpetRegisters->m_GeneralCapsRegister;
 	
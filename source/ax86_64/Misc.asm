@@ -21,6 +21,10 @@ global Arch_APIC_OnIPInterrupt_Asm
 extern Arch_APIC_OnIPInterrupt
 global Arch_APIC_OnSpInterrupt_Asm
 extern Arch_APIC_OnSpInterrupt
+global Arch_TLB_OnShootdownInterrupt_Asm
+extern Arch_TLB_OnShootdownInterrupt
+global Arch_APIC_OnDrainInterrupt_Asm
+extern Arch_APIC_OnDrainInterrupt
 
 global CPU_OnPageFault_Asm
 extern CPU_OnPageFault
@@ -138,6 +142,30 @@ Arch_APIC_OnTimerInterrupt_Asm:
 	POP_ALL
 	iretq
 	
+; Implements the assembly stub which calls into the C function, which then flushes the TLB entries queued by other CPUs.
+Arch_TLB_OnShootdownInterrupt_Asm:
+	PUSH_ALL_NO_ERC
+	SWAP_GS_IF_NEEDED
+	
+	mov  rdi, rsp
+	call Arch_TLB_OnShootdownInterrupt
+	
+	SWAP_GS_BACK_IF_NEEDED
+	POP_ALL
+	iretq
+
+; Implements the assembly stub which calls into the C function, which then drains this CPU's page cache.
+Arch_APIC_OnDrainInterrupt_Asm:
+	PUSH_ALL_NO_ERC
+	SWAP_GS_IF_NEEDED
+	
+	mov  rdi, rsp
+	call Arch_APIC_OnDrainInterrupt
+	
+	SWAP_GS_BACK_IF_NEEDED
+	POP_ALL
+	iretq
+
 ; it's probably fine if we get a spurious interrupt. We don't really need to handle it
 Arch_APIC_OnSpInterrupt_Asm:
 	PUSH_ALL_NO_ERC
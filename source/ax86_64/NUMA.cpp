@@ -0,0 +1,307 @@
+//  ***************************************************************
+//  ax86_64/NUMA.cpp - Creation date: 17/10/2023
+//  -------------------------------------------------------------
+//  NanoShell64 Copyright (C) 2023 - Licensed under GPL V3
+//
+//  ***************************************************************
+//  Programmer(s):  iProgramInCpp (iprogramincpp@gmail.com)
+//  ***************************************************************
+//  
+//  Module description:
+//      This module parses the ACPI SRAT and SLIT tables, which
+//    describe which NUMA node each memory range and processor
+//    belongs to, and how far apart the nodes are.
+//
+//  ***************************************************************
+#include <Arch.hpp>
+
+using namespace Arch;
+
+struct SRATTable
+{
+	RSD::Table m_header;
+	
+	uint32_t m_Reserved0;
+	uint64_t m_Reserved1;
+	
+	uint8_t  m_Entries[0];
+}
+PACKED;
+
+enum
+{
+	SRAT_LAPIC_AFFINITY  = 0,
+	SRAT_MEMORY_AFFINITY = 1,
+	SRAT_X2APIC_AFFINITY = 2,
+};
+
+struct SRATEntry
+{
+	uint8_t m_Type;
+	uint8_t m_Length;
+}
+PACKED;
+
+struct SRATLapicAffinity
+{
+	SRATEntry m_entry;
+	uint8_t   m_DomainLow;
+	uint8_t   m_LapicID;
+	uint32_t  m_Flags;
+	uint8_t   m_SapicEID;
+	uint8_t   m_DomainHigh[3];
+	uint32_t  m_ClockDomain;
+}
+PACKED;
+
+struct SRATMemoryAffinity
+{
+	SRATEntry m_entry;
+	uint32_t  m_Domain;
+	uint16_t  m_Reserved0;
+	uint64_t  m_Base;
+	uint64_t  m_Length;
+	uint32_t  m_Reserved1;
+	uint32_t  m_Flags;
+	uint64_t  m_Reserved2;
+}
+PACKED;
+
+struct SRATX2ApicAffinity
+{
+	SRATEntry m_entry;
+	uint16_t  m_Reserved0;
+	uint32_t  m_Domain;
+	uint32_t  m_X2ApicID;
+	uint32_t  m_Flags;
+	uint32_t  m_ClockDomain;
+	uint32_t  m_Reserved1;
+}
+PACKED;
+
+struct SLITTable
+{
+	RSD::Table m_header;
+	
+	uint64_t m_LocalityCount;
+	uint8_t  m_Entries[0];
+}
+PACKED;
+
+constexpr uint32_t C_SRAT_ENABLED = BIT(0);
+
+constexpr int C_LOCAL_DISTANCE  = 10;
+constexpr int C_REMOTE_DISTANCE = 20;
+
+constexpr int C_MAX_MEMORY_RANGES = 64;
+constexpr int C_MAX_CPU_AFFINITIES = 256;
+
+struct NumaMemoryRange
+{
+	uintptr_t m_base;
+	uint64_t  m_length;
+	int       m_node;
+};
+
+struct NumaCpuAffinity
+{
+	uint32_t m_lapicID;
+	int      m_node;
+};
+
+static int s_nodeCount = 1;
+static uint32_t s_nodeDomains[NUMA::C_MAX_NODES];
+static uint8_t  s_distances[NUMA::C_MAX_NODES][NUMA::C_MAX_NODES];
+
+static NumaMemoryRange s_memoryRanges[C_MAX_MEMORY_RANGES];
+static int s_memoryRangeCount;
+
+static NumaCpuAffinity s_cpuAffinities[C_MAX_CPU_AFFINITIES];
+static int s_cpuAffinityCount;
+
+// Get the node index of a proximity domain, assigning it a new one if needed.
+static int GetNodeOfDomain(uint32_t domain)
+{
+	for (int i = 0; i < s_nodeCount; i++)
+	{
+		if (s_nodeDomains[i] == domain)
+			return i;
+	}
+	
+	if (s_nodeCount >= NUMA::C_MAX_NODES)
+	{
+		SLogMsg("NUMA: Too many proximity domains, domain %u will be merged with node 0", domain);
+		return 0;
+	}
+	
+	s_nodeDomains[s_nodeCount] = domain;
+	return s_nodeCount++;
+}
+
+static void AddCpuAffinity(uint32_t lapicID, uint32_t domain)
+{
+	if (s_cpuAffinityCount >= C_MAX_CPU_AFFINITIES)
+		return;
+	
+	s_cpuAffinities[s_cpuAffinityCount++] = { lapicID, GetNodeOfDomain(domain) };
+}
+
+static void AddMemoryRange(uintptr_t base, uint64_t length, uint32_t domain)
+{
+	if (s_memoryRangeCount >= C_MAX_MEMORY_RANGES)
+	{
+		SLogMsg("NUMA: Too many memory ranges, ignoring range %p", base);
+		return;
+	}
+	
+	s_memoryRanges[s_memoryRangeCount++] = { base, length, GetNodeOfDomain(domain) };
+}
+
+static void ParseSRAT(SRATTable* pSrat)
+{
+	uint8_t* pEntry = pSrat->m_Entries;
+	uint8_t* pEnd   = (uint8_t*)pSrat + pSrat->m_header.m_Length;
+	
+	while (pEntry + sizeof(SRATEntry) <= pEnd)
+	{
+		SRATEntry* pHdr = (SRATEntry*)pEntry;
+		if (pHdr->m_Length == 0)
+			break;
+		
+		switch (pHdr->m_Type)
+		{
+			case SRAT_LAPIC_AFFINITY:
+			{
+				SRATLapicAffinity* pAff = (SRATLapicAffinity*)pEntry;
+				if (!(pAff->m_Flags & C_SRAT_ENABLED))
+					break;
+				
+				uint32_t domain = pAff->m_DomainLow | pAff->m_DomainHigh[0] << 8 | pAff->m_DomainHigh[1] << 16 | pAff->m_DomainHigh[2] << 24;
+				AddCpuAffinity(pAff->m_LapicID, domain);
+				break;
+			}
+			case SRAT_X2APIC_AFFINITY:
+			{
+				SRATX2ApicAffinity* pAff = (SRATX2ApicAffinity*)pEntry;
+				if (!(pAff->m_Flags & C_SRAT_ENABLED))
+					break;
+				
+				AddCpuAffinity(pAff->m_X2ApicID, pAff->m_Domain);
+				break;
+			}
+			case SRAT_MEMORY_AFFINITY:
+			{
+				SRATMemoryAffinity* pAff = (SRATMemoryAffinity*)pEntry;
+				if (!(pAff->m_Flags & C_SRAT_ENABLED) || pAff->m_Length == 0)
+					break;
+				
+				AddMemoryRange(pAff->m_Base, pAff->m_Length, pAff->m_Domain);
+				break;
+			}
+		}
+		
+		pEntry += pHdr->m_Length;
+	}
+}
+
+static void ParseSLIT(SLITTable* pSlit)
+{
+	uint64_t count = pSlit->m_LocalityCount;
+	
+	for (int i = 0; i < s_nodeCount; i++)
+	{
+		for (int j = 0; j < s_nodeCount; j++)
+		{
+			uint64_t from = s_nodeDomains[i], to = s_nodeDomains[j];
+			if (from >= count || to >= count)
+				continue;
+			
+			s_distances[i][j] = pSlit->m_Entries[from * count + to];
+		}
+	}
+}
+
+void NUMA::Init()
+{
+	s_nodeCount = 1;
+	s_nodeDomains[0] = 0;
+	
+	SRATTable* pSrat = (SRATTable*)RSD::FindTable("SRAT");
+	if (pSrat)
+	{
+		// Let the first domain we see be node 0.
+		s_nodeCount = 0;
+		ParseSRAT(pSrat);
+		
+		if (s_nodeCount == 0)
+			s_nodeCount = 1;
+	}
+	
+	// Fill in the default distances first, in case there's no SLIT.
+	for (int i = 0; i < s_nodeCount; i++)
+	{
+		for (int j = 0; j < s_nodeCount; j++)
+			s_distances[i][j] = i == j ? C_LOCAL_DISTANCE : C_REMOTE_DISTANCE;
+	}
+	
+	SLITTable* pSlit = (SLITTable*)RSD::FindTable("SLIT");
+	if (pSlit && pSrat)
+		ParseSLIT(pSlit);
+	
+	if (s_nodeCount > 1)
+		LogMsg("NUMA: %d nodes, %d memory ranges, %d processors", s_nodeCount, s_memoryRangeCount, s_cpuAffinityCount);
+	
+	for (int i = 0; i < s_memoryRangeCount; i++)
+		SLogMsg("NUMA: Memory range %p-%p belongs to node %d", s_memoryRanges[i].m_base, s_memoryRanges[i].m_base + s_memoryRanges[i].m_length, s_memoryRanges[i].m_node);
+}
+
+int NUMA::GetNodeCount()
+{
+	return s_nodeCount;
+}
+
+int NUMA::GetNodeOfRange(uintptr_t base, uint64_t& length)
+{
+	int node = 0;
+	uintptr_t end = base + length;
+	
+	for (int i = 0; i < s_memoryRangeCount; i++)
+	{
+		NumaMemoryRange& range = s_memoryRanges[i];
+		uintptr_t rangeEnd = range.m_base + range.m_length;
+		
+		if (range.m_base <= base && base < rangeEnd)
+		{
+			node = range.m_node;
+			if (end > rangeEnd)
+				end = rangeEnd;
+		}
+		else if (base < range.m_base && range.m_base < end)
+		{
+			// Another node's range starts in the middle of this one.
+			end = range.m_base;
+		}
+	}
+	
+	length = end - base;
+	return node;
+}
+
+int NUMA::GetNodeOfLapic(uint32_t lapicID)
+{
+	for (int i = 0; i < s_cpuAffinityCount; i++)
+	{
+		if (s_cpuAffinities[i].m_lapicID == lapicID)
+			return s_cpuAffinities[i].m_node;
+	}
+	
+	return 0;
+}
+
+int NUMA::GetDistance(int from, int to)
+{
+	if (from < 0 || from >= s_nodeCount || to < 0 || to >= s_nodeCount)
+		return C_REMOTE_DISTANCE;
+	
+	return s_distances[from][to];
+}
@@ -40,6 +40,27 @@ void RSD::LoadTable(RSD::Table* pTable)
 	}
 }
 
+RSD::Table* RSD::FindTable(const char* pSignature)
+{
+	if (!g_RSDPRequest.response)
+		return NULL;
+	
+	Descriptor* pDesc = (Descriptor*)g_RSDPRequest.response->address;
+	
+	Table* pRoot = (Table*)(Arch::GetHHDMOffset() + pDesc->GetRSDTAddress());
+	
+	int count = pRoot->GetSubSDTCount();
+	for (int i = 0; i < count; i++)
+	{
+		Table* pTable = (Table*)(Arch::GetHHDMOffset() + pRoot->m_SubSDTs[i]);
+		
+		if (memcmp(pTable->m_Signature, pSignature, 4) == 0)
+			return pTable;
+	}
+	
+	return NULL;
+}
+
 void RSD::Load()
 {
 	Descriptor* pDesc = (Descriptor*)g_RSDPRequest.response->address;
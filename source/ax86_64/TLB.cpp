@@ -0,0 +1,408 @@
+//  ***************************************************************
+//  ax86_64/TLB.cpp - Creation date: 17/10/2023
+//  -------------------------------------------------------------
+//  NanoShell64 Copyright (C) 2023 - Licensed under GPL V3
+//
+//  ***************************************************************
+//  Programmer(s):  iProgramInCpp (iprogramincpp@gmail.com)
+//  ***************************************************************
+//  
+//  Module description:
+//      This module implements TLB shootdowns. The ranges a CPU
+//    wants flushed are queued on each of the other CPUs, which
+//    are then sent a single IPI to flush everything that was
+//    queued on them so far.
+//      It also hands out PCIDs to page mappings, so that their
+//    TLB entries survive switching between them.
+//
+//  ***************************************************************
+#include <Arch.hpp>
+
+using namespace Arch;
+
+constexpr uintptr_t C_KERNEL_HALF_START = 0xFFFF800000000000;
+
+// The number of CPUs whose flushes are queued before waiting for them to finish.
+constexpr uint64_t C_TARGETS_PER_ROUND = 64;
+
+static Atomic<uint64_t> s_ipisSent;
+static Atomic<uint64_t> s_pagesFlushed;
+static Atomic<uint64_t> s_fullFlushes;
+static Atomic<uint64_t> s_pcidHits;
+static Atomic<uint64_t> s_pcidRecycles;
+
+extern "C" void Arch_TLB_OnShootdownInterrupt(Registers* pRegs)
+{
+	CPU* pCpu = CPU::GetCurrent();
+	
+	// make sure to let ourselves know that right now, interrupts are disabled.
+	pCpu->InterruptsEnabledRaw() = false;
+	
+	TLB::ProcessQueue();
+	
+	// Send an EOI.
+	APIC::EndOfInterrupt();
+	
+	// go back to the old state
+	pCpu->InterruptsEnabledRaw() = (pRegs->rflags & C_RFLAGS_INTERRUPT_FLAG);
+}
+
+void TLB::RangeList::Add(uintptr_t start, size_t pageCount)
+{
+	if (m_bFullFlush || pageCount == 0)
+		return;
+	
+	// Work with page numbers, so that a range ending at the top of the address space doesn't overflow.
+	uintptr_t first = start >> 12, end = first + pageCount;
+	
+	for (size_t i = 0; i < m_rangeCount; )
+	{
+		Range& r = m_ranges[i];
+		uintptr_t rFirst = r.m_start >> 12, rEnd = rFirst + r.m_pageCount;
+		
+		if (first > rEnd || rFirst > end)
+		{
+			i++;
+			continue;
+		}
+		
+		// The ranges overlap or touch, so absorb this one into the new range. Since the new range
+		// has grown, it may now touch a range that was checked already, so start over.
+		if (first > rFirst) first = rFirst;
+		if (end   < rEnd)   end   = rEnd;
+		
+		m_pageCount -= r.m_pageCount;
+		r = m_ranges[--m_rangeCount];
+		i = 0;
+	}
+	
+	pageCount = end - first;
+	
+	if (m_rangeCount >= C_MAX_RANGES || m_pageCount + pageCount > C_FULL_FLUSH_THRESHOLD)
+	{
+		m_bFullFlush = true;
+		m_rangeCount = 0;
+		m_pageCount  = 0;
+		return;
+	}
+	
+	m_ranges[m_rangeCount++] = { first << 12, pageCount };
+	m_pageCount += pageCount;
+}
+
+void TLB::RangeList::Add(const RangeList& other)
+{
+	if (other.m_bFullFlush)
+	{
+		m_bFullFlush = true;
+		m_rangeCount = 0;
+		m_pageCount  = 0;
+		return;
+	}
+	
+	for (size_t i = 0; i < other.m_rangeCount; i++)
+		Add(other.m_ranges[i].m_start, other.m_ranges[i].m_pageCount);
+}
+
+void TLB::RangeList::Clear()
+{
+	m_rangeCount = 0;
+	m_pageCount  = 0;
+	m_bFullFlush = false;
+}
+
+// Kernel mappings are cached under every PCID, but only the current one can be flushed directly. The others
+// are flushed the next time they're loaded.
+static void InvalidateOtherPCIDs()
+{
+	CPU* pCpu = CPU::GetCurrent();
+	if (!pCpu)
+		return;
+	
+	TLB::PcidCache& cache = pCpu->GetPcidCache();
+	if (!cache.m_bEnabled)
+		return;
+	
+	cache.m_flushGen++;
+	cache.m_slots[cache.m_current].m_flushGen = cache.m_flushGen;
+}
+
+void TLB::FlushAll()
+{
+	uintptr_t cr4 = ReadCR4();
+	
+	// Toggling CR4.PGE gets rid of every entry, including global pages, under every PCID.
+	if (cr4 & C_CR4_PGE)
+	{
+		WriteCR4(cr4 & ~C_CR4_PGE);
+		WriteCR4(cr4);
+		return;
+	}
+	
+	// So does an all-context INVPCID.
+	CPU* pCpu = CPU::GetCurrent();
+	if (pCpu && pCpu->GetPcidCache().m_bInvpcid)
+	{
+		constexpr uint64_t C_INVPCID_ALL_CONTEXTS = 2;
+		
+		struct { uint64_t m_pcid, m_addr; } desc = { 0, 0 };
+		ASM("invpcid %0, %1"::"m"(desc),"r"(C_INVPCID_ALL_CONTEXTS):"memory");
+		return;
+	}
+	
+	// Reloading CR3 only flushes the current PCID.
+	InvalidateOtherPCIDs();
+	WriteCR3(ReadCR3());
+}
+
+static void FlushLocal(const TLB::RangeList& list, bool bKernel)
+{
+	if (list.Empty())
+		return;
+	
+	if (bKernel)
+		InvalidateOtherPCIDs();
+	
+	if (list.m_bFullFlush)
+	{
+		TLB::FlushAll();
+		s_fullFlushes.FetchAdd(1);
+		return;
+	}
+	
+	for (size_t i = 0; i < list.m_rangeCount; i++)
+	{
+		const TLB::Range& r = list.m_ranges[i];
+		
+		for (size_t j = 0; j < r.m_pageCount; j++)
+			Invalidate(r.m_start + j * PAGE_SIZE);
+	}
+	
+	s_pagesFlushed.FetchAdd(list.m_pageCount);
+}
+
+void TLB::ProcessQueue()
+{
+	Queue& q = CPU::GetCurrent()->GetTlbQueue();
+	
+	if (q.m_requestedGen.Load() == q.m_completedGen.Load())
+		return;
+	
+	RangeList list;
+	
+	q.m_lock.Lock();
+	list = q.m_pending;
+	q.m_pending.Clear();
+	q.m_bIpiPending = false;
+	uint64_t gen = q.m_requestedGen.Load();
+	q.m_lock.Unlock();
+	
+	FlushLocal(list, true);
+	
+	q.m_completedGen.Store(gen);
+}
+
+void TLB::OnCPUOnline()
+{
+	CPU::GetCurrent()->GetTlbQueue().m_bOnline.Store(true);
+	
+	// Any shootdown sent before this point has skipped us, so start from a clean TLB.
+	FlushAll();
+}
+
+// Queues a list of ranges on every other CPU, and waits until they have all been flushed.
+static void SendToOtherCPUs(CPU* pSelf, const TLB::RangeList& list)
+{
+	uint64_t cpuCount = CPU::GetCount();
+	uint64_t gens[C_TARGETS_PER_ROUND];
+	
+	for (uint64_t base = 0; base < cpuCount; base += C_TARGETS_PER_ROUND)
+	{
+		uint64_t count = cpuCount - base;
+		if (count > C_TARGETS_PER_ROUND)
+			count = C_TARGETS_PER_ROUND;
+		
+		for (uint64_t i = 0; i < count; i++)
+		{
+			gens[i] = 0;
+			
+			CPU* pCpu = CPU::GetCPU(base + i);
+			if (!pCpu || pCpu == pSelf)
+				continue;
+			
+			TLB::Queue& q = pCpu->GetTlbQueue();
+			if (!q.m_bOnline.Load())
+				continue;
+			
+			q.m_lock.Lock();
+			q.m_pending.Add(list);
+			gens[i] = q.m_requestedGen.AddFetch(1);
+			
+			// If an IPI is already on its way, the CPU will pick up our ranges too.
+			bool bSend = !q.m_bIpiPending;
+			q.m_bIpiPending = true;
+			q.m_lock.Unlock();
+			
+			if (bSend)
+			{
+				APIC::SendIPI(pCpu->GetLapicID(), IDT::INT_TLB_SHOOTDOWN);
+				s_ipisSent.FetchAdd(1);
+			}
+		}
+		
+		for (uint64_t i = 0; i < count; i++)
+		{
+			if (!gens[i])
+				continue;
+			
+			TLB::Queue& q = CPU::GetCPU(base + i)->GetTlbQueue();
+			
+			// While we wait, carry out the flushes others have requested from us, since
+			// they might be waiting on us in the same way, with their interrupts disabled.
+			while (q.m_completedGen.Load() < gens[i])
+			{
+				TLB::ProcessQueue();
+				Spinlock::SpinHint();
+			}
+		}
+	}
+}
+
+void TLB::Batch::Add(uintptr_t addr, size_t pageCount)
+{
+	if (addr >= C_KERNEL_HALF_START)
+		m_global.Add(addr, pageCount);
+	else
+		m_local.Add(addr, pageCount);
+}
+
+void TLB::Batch::Flush()
+{
+	if (m_local.Empty() && m_global.Empty())
+		return;
+	
+	// If the CPU objects aren't set up yet, only the bootstrap processor is running.
+	CPU* pCpu = CPU::GetCurrent();
+	if (!pCpu)
+	{
+		FlushLocal(m_local, false);
+		FlushLocal(m_global, true);
+		m_local.Clear();
+		m_global.Clear();
+		return;
+	}
+	
+	bool bInts = pCpu->SetInterruptsEnabled(false);
+	
+	if (!m_global.Empty())
+		SendToOtherCPUs(pCpu, m_global);
+	
+	FlushLocal(m_local, false);
+	FlushLocal(m_global, true);
+	
+	pCpu->SetInterruptsEnabled(bInts);
+	
+	m_local.Clear();
+	m_global.Clear();
+}
+
+void TLB::InitPCID()
+{
+	uint32_t eax, ebx, ecx, edx;
+	ASM("cpuid":"=a"(eax),"=b"(ebx),"=c"(ecx),"=d"(edx):"a"(1),"c"(0));
+	
+	constexpr uint32_t C_CPUID_PCID = BIT(17);
+	if (~ecx & C_CPUID_PCID)
+		return;
+	
+	// CR4.PCIDE may only be set while CR3's PCID is zero.
+	if (ReadCR3() & 0xFFF)
+		return;
+	
+	WriteCR4(ReadCR4() | C_CR4_PCIDE);
+	
+	PcidCache& cache = CPU::GetCurrent()->GetPcidCache();
+	cache.m_bEnabled = true;
+	
+	// INVPCID support is reported in leaf 7, if there is one.
+	ASM("cpuid":"=a"(eax),"=b"(ebx),"=c"(ecx),"=d"(edx):"a"(0),"c"(0));
+	if (eax < 7)
+		return;
+	
+	constexpr uint32_t C_CPUID_INVPCID = BIT(10);
+	ASM("cpuid":"=a"(eax),"=b"(ebx),"=c"(ecx),"=d"(edx):"a"(7),"c"(0));
+	cache.m_bInvpcid = (ebx & C_CPUID_INVPCID) != 0;
+}
+
+void TLB::LoadAddressSpace(uintptr_t pml4, uint64_t generation)
+{
+	CPU* pCpu = CPU::GetCurrent();
+	if (!pCpu || !pCpu->GetPcidCache().m_bEnabled)
+	{
+		WriteCR3(pml4);
+		return;
+	}
+	
+	bool bInts = pCpu->SetInterruptsEnabled(false);
+	
+	PcidCache& cache = pCpu->GetPcidCache();
+	
+	// Look for the PCID this mapping was given before, and pick the least recently used one in case there's none.
+	int pcid = 0, victim = 1;
+	for (int i = 1; i < C_PCID_COUNT; i++)
+	{
+		if (cache.m_slots[i].m_owner == pml4)
+		{
+			pcid = i;
+			break;
+		}
+		
+		if (cache.m_slots[i].m_lastUse < cache.m_slots[victim].m_lastUse)
+			victim = i;
+	}
+	
+	bool bFlush = true;
+	if (pcid)
+	{
+		PcidSlot& slot = cache.m_slots[pcid];
+		bFlush = slot.m_ownerGen != generation || slot.m_flushGen != cache.m_flushGen;
+	}
+	else
+	{
+		// The PCID's entries belong to another mapping, so they have to go.
+		pcid = victim;
+		cache.m_slots[pcid].m_owner = pml4;
+		
+		s_pcidRecycles.FetchAdd(1);
+	}
+	
+	PcidSlot& slot = cache.m_slots[pcid];
+	slot.m_ownerGen = generation;
+	slot.m_flushGen = cache.m_flushGen;
+	slot.m_lastUse  = ++cache.m_clock;
+	cache.m_current = pcid;
+	
+	if (!bFlush)
+		s_pcidHits.FetchAdd(1);
+	
+	WriteCR3(pml4 | pcid | (bFlush ? 0 : C_CR3_NOFLUSH));
+	
+	pCpu->SetInterruptsEnabled(bInts);
+}
+
+void TLB::Shootdown(uintptr_t addr, size_t pageCount)
+{
+	Batch batch;
+	batch.Add(addr, pageCount);
+}
+
+TLB::Stats TLB::GetStats()
+{
+	Stats stats;
+	stats.m_ipisSent     = s_ipisSent.Load();
+	stats.m_pagesFlushed = s_pagesFlushed.Load();
+	stats.m_fullFlushes  = s_fullFlushes.Load();
+	stats.m_pcidHits     = s_pcidHits.Load();
+	stats.m_pcidRecycles = s_pcidRecycles.Load();
+	return stats;
+}